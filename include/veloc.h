@@ -111,6 +111,13 @@ int VELOC_Checkpoint_wait();
 //Note, returns VELOC_FAILURE if client is null.
 int VELOC_Checkpoint_finished();
 
+// Same as VELOC_Checkpoint_wait and VELOC_Checkpoint_finished, restricted to a single checkpoint: earlier or later
+// checkpoints may still be in progress. Checkpoints not in progress (e.g. already waited for) count as successful.
+//   IN name - label of the checkpoint
+//   IN version - version of the checkpoint
+int VELOC_Checkpoint_wait_version(const char *name, int version);
+int VELOC_Checkpoint_finished_version(const char *name, int version);
+
 // convenience wrapper for VELOC_Checkpoint_wait, VELOC_Checkpoint_begin, VELOC_Checkpoint_mem, VELOC_Checkpoint_end
 int VELOC_Checkpoint(const char *name, int version);
 
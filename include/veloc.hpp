@@ -35,6 +35,8 @@ public:
     virtual bool checkpoint_end(bool success) = 0;
     virtual bool checkpoint_wait() = 0;
     virtual bool checkpoint_finished() = 0;
+    virtual bool checkpoint_wait(const std::string &name, int version) = 0;
+    virtual bool checkpoint_finished(const std::string &name, int version) = 0;
 
     virtual int restart_test(const std::string &name, int version, int target_rank = -1) = 0;
     virtual bool restart(const std::string &name, int version, int target_rank = -1) = 0;
@@ -2,20 +2,84 @@
 #include "common/command.hpp"
 #include "modules/module_manager.hpp"
 
-#include <queue>
-#include <future>
+#include <deque>
+#include <algorithm>
+#include <chrono>
 #include <sched.h>
 #include <condition_variable>
 #include <mutex>
 #include <thread>
 
+//#define __DEBUG
+#include "common/debug.hpp"
+
+// control commands are short, a few threads are enough to keep them from waiting behind each other
+static const unsigned int CONTROL_THREADS = 4;
+
+// commands waiting for a worker, one FIFO per priority class
+class scheduler_t {
+    typedef std::chrono::steady_clock clock_type;
+    struct job_t {
+        command_t cmd;
+        completion_t completion;
+        clock_type::time_point queued;
+    };
+    std::deque<job_t> queues[command_t::PRIORITIES];
+    std::mutex mutex;
+    std::condition_variable cond;
+    clock_type::duration aging;
+
+public:
+    scheduler_t(unsigned int aging_interval) : aging(std::chrono::seconds(aging_interval)) { }
+
+    void push(const command_t &c, const completion_t &f) {
+        std::unique_lock<std::mutex> lock(mutex);
+        queues[c.priority()].push_back({c, f, clock_type::now()});
+        lock.unlock();
+        cond.notify_one();
+    }
+
+    void pop(command_t &c, completion_t &f) {
+        std::unique_lock<std::mutex> lock(mutex);
+        int best;
+        while (true) {
+            // a job moves up one class for each aging interval it has waited, so flushes are not starved
+            auto now = clock_type::now();
+            long best_priority = 0;
+            best = -1;
+            for (int i = 0; i < command_t::PRIORITIES; i++) {
+                if (queues[i].empty())
+                    continue;
+                long priority = i;
+                if (aging.count() > 0)
+                    priority -= (now - queues[i].front().queued) / aging;
+                if (best == -1 || priority < best_priority) {
+                    best = i;
+                    best_priority = priority;
+                }
+            }
+            if (best != -1)
+                break;
+            cond.wait(lock);
+        }
+        job_t &job = queues[best].front();
+        c = job.cmd;
+        f = std::move(job.completion);
+        queues[best].pop_front();
+    }
+};
+
 void start_main_loop(const config_t &cfg, MPI_Comm comm) {
     std::condition_variable thread_cond;
     bool init_finished = false;
     std::thread([&]() {
-        unsigned int max_parallelism;
+        unsigned int max_parallelism, aging_interval;
         if (!cfg.get_optional("max_parallelism", max_parallelism))
             max_parallelism = std::thread::hardware_concurrency();
+        // hardware_concurrency may not know the number of cores
+        max_parallelism = std::max(max_parallelism, 1u);
+        if (!cfg.get_optional("priority_aging", aging_interval))
+            aging_interval = 10;
 
         cpu_set_t cpu_mask;
         CPU_ZERO(&cpu_mask);
@@ -31,20 +95,42 @@ void start_main_loop(const config_t &cfg, MPI_Comm comm) {
         init_finished = true;
         thread_cond.notify_all();
 
-        std::queue<std::future<void> > work_queue;
-        command_t c;
-        while (true) {
-            auto f = command_queue.dequeue_any(c);
-            work_queue.push(std::async(std::launch::async, [=, &modules] {
+        // restarts and flushes are limited to max_parallelism workers, served by priority
+        scheduler_t scheduler(aging_interval);
+        for (unsigned int i = 0; i < max_parallelism; i++)
+            std::thread([&scheduler, &modules, cpu_mask] {
                 // lower worker thread priority and set its affinity to whole CPUSET
                 sched_setaffinity(0, sizeof(cpu_set_t), &cpu_mask);
                 nice(10);
-                f(modules.notify_command(c));
-            }));
-            if (work_queue.size() >= (unsigned int)max_parallelism) {
-                work_queue.front().wait();
-                work_queue.pop();
-            }
+                command_t c;
+                completion_t f;
+                while (true) {
+                    scheduler.pop(c, f);
+                    DBG("scheduled command " << c);
+                    f(modules.notify_command(c));
+                }
+            }).detach();
+        // control commands are latency sensitive, they have their own threads and never wait behind the workers
+        scheduler_t control(0);
+        for (unsigned int i = 0; i < CONTROL_THREADS; i++)
+            std::thread([&control, &modules] {
+                command_t c;
+                completion_t f;
+                while (true) {
+                    control.pop(c, f);
+                    f(modules.notify_command(c));
+                }
+            }).detach();
+        command_t c;
+        while (true) {
+            auto f = command_queue.dequeue_any(c);
+            modules.notify_queued(c);
+            if (c.command == command_t::ADMIT)
+                modules.notify_admit(c, f);
+            else if (c.priority() == command_t::PRIORITY_CONTROL)
+                control.push(c, f);
+            else
+                scheduler.push(c, f);
         }
     }).detach();
     std::mutex thread_lock;
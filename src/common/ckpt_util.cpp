@@ -1,36 +1,347 @@
 #include "ckpt_util.hpp"
-#include <fstream>
+#include "storage/storage_module.hpp"
+
+#include <stdexcept>
+#include <cstring>
+#include <vector>
+#include <algorithm>
+
+#ifdef WITH_ZLIB
+#include <zlib.h>
+#endif
 
 #define __DEBUG
 #include "debug.hpp"
 
-size_t read_header(const std::string &ckpt_name, std::map<int, size_t> &region_info) {
-    size_t header_size;
+const char ckpt_header_t::MAGIC[8] = {'V', 'E', 'L', 'O', 'C', 'H', 'D', 'R'};
+
+// on-disk layout of v2: magic, version, reserved, alignment, number of regions, then one entry per region
+static const size_t V2_FIXED_SIZE = sizeof(ckpt_header_t::MAGIC) + 2 * sizeof(uint32_t) + 2 * sizeof(uint64_t);
+static const size_t V2_ENTRY_SIZE = sizeof(int32_t) + sizeof(uint32_t) + 2 * sizeof(uint64_t) + 2 * sizeof(uint32_t);
+
+size_t ckpt_header_t::size() const {
+    if (version == 1)
+        return sizeof(size_t) + regions.size() * (sizeof(int) + sizeof(size_t));
+    return V2_FIXED_SIZE + regions.size() * V2_ENTRY_SIZE;
+}
+
+size_t ckpt_header_t::layout() {
+    size_t align = std::max(alignment, (size_t)1), offset = size();
+    for (auto &e : regions) {
+        offset = (offset + align - 1) / align * align;
+        e.second.offset = offset;
+        offset += e.second.size;
+    }
+    return offset;
+}
+
+template <typename T> static void append_field(std::string &buffer, T value) {
+    buffer.append((const char *)&value, sizeof(T));
+}
+
+template <typename T> static T extract_field(const char *&ptr) {
+    T value;
+    memcpy(&value, ptr, sizeof(T));
+    ptr += sizeof(T);
+    return value;
+}
 
-    region_info.clear();
+std::string ckpt_header_t::serialize() const {
+    std::string buffer(MAGIC, sizeof(MAGIC));
+    append_field<uint32_t>(buffer, VERSION);
+    append_field<uint32_t>(buffer, 0);
+    append_field<uint64_t>(buffer, alignment);
+    append_field<uint64_t>(buffer, regions.size());
+    for (auto &e : regions) {
+        append_field<int32_t>(buffer, e.first);
+        append_field<uint32_t>(buffer, e.second.flags);
+        append_field<uint64_t>(buffer, e.second.offset);
+        append_field<uint64_t>(buffer, e.second.size);
+        append_field<uint32_t>(buffer, e.second.chksum);
+        append_field<uint32_t>(buffer, 0);
+    }
+    return buffer;
+}
+
+static void read_exact(storage_reader_t &reader, void *buf, size_t size, size_t offset) {
+    if (offset + size > reader.size() || !reader.read((char *)buf, size, offset))
+        throw std::runtime_error("cannot read " + std::to_string(size) + " bytes at offset " + std::to_string(offset));
+}
+
+static void read_header_v1(storage_reader_t &reader, ckpt_header_t &header) {
+    size_t file_size = reader.size(), no_regions, expected_size = 0;
+    header.version = 1;
+    header.alignment = 1;
+    read_exact(reader, &no_regions, sizeof(size_t), 0);
+    const size_t entry_size = sizeof(int) + sizeof(size_t);
+    if (no_regions > file_size / entry_size)
+        throw std::runtime_error("invalid number of regions " + std::to_string(no_regions));
+    std::vector<char> entries(no_regions * entry_size);
+    read_exact(reader, entries.data(), entries.size(), sizeof(size_t));
+    const char *ptr = entries.data();
+    for (size_t i = 0; i < no_regions; i++) {
+        int id = extract_field<int>(ptr);
+        size_t region_size = extract_field<size_t>(ptr);
+        header.regions[id].size = region_size;
+        expected_size += region_size;
+    }
+    size_t header_size = sizeof(size_t) + entries.size();
+    if (file_size < header_size + expected_size)
+        throw std::runtime_error("file size " + std::to_string(file_size - header_size) + " is smaller than expected size " + std::to_string(expected_size));
+    // the header may be padded (e.g. for O_DIRECT), in which case the data is aligned at the end of the file
+    size_t offset = file_size - expected_size;
+    for (auto &e : header.regions) {
+        e.second.offset = offset;
+        offset += e.second.size;
+    }
+}
+
+static void read_header_v2(storage_reader_t &reader, ckpt_header_t &header) {
+    size_t file_size = reader.size();
+    char fixed[V2_FIXED_SIZE];
+    read_exact(reader, fixed, V2_FIXED_SIZE, 0);
+    const char *ptr = fixed + sizeof(ckpt_header_t::MAGIC);
+    header.version = extract_field<uint32_t>(ptr);
+    extract_field<uint32_t>(ptr);
+    header.alignment = extract_field<uint64_t>(ptr);
+    uint64_t no_regions = extract_field<uint64_t>(ptr);
+    if (header.version != ckpt_header_t::VERSION)
+        throw std::runtime_error("unsupported header version " + std::to_string(header.version));
+    if (no_regions > file_size / V2_ENTRY_SIZE)
+        throw std::runtime_error("invalid number of regions " + std::to_string(no_regions));
+    std::vector<char> entries(no_regions * V2_ENTRY_SIZE);
+    read_exact(reader, entries.data(), entries.size(), V2_FIXED_SIZE);
+    ptr = entries.data();
+    for (uint64_t i = 0; i < no_regions; i++) {
+        int id = extract_field<int32_t>(ptr);
+        region_entry_t &e = header.regions[id];
+        e.flags = extract_field<uint32_t>(ptr);
+        e.offset = extract_field<uint64_t>(ptr);
+        e.size = extract_field<uint64_t>(ptr);
+        e.chksum = extract_field<uint32_t>(ptr);
+        extract_field<uint32_t>(ptr);
+    }
+    if (header.regions.size() != no_regions)
+        throw std::runtime_error("duplicate region ids in a table of " + std::to_string(no_regions) + " regions");
+    // the header size is only known once the whole table has been parsed
+    size_t header_size = header.size();
+    for (auto &e : header.regions)
+        if (e.second.offset < header_size || e.second.size > file_size || e.second.offset > file_size - e.second.size)
+            throw std::runtime_error("region " + std::to_string(e.first) + " at offset " + std::to_string(e.second.offset)
+                                     + " of size " + std::to_string(e.second.size) + " is outside of the file");
+}
+
+bool read_header(storage_reader_t &reader, ckpt_header_t &header) {
+    header.regions.clear();
     try {
-        std::ifstream f;
-        size_t expected_size = 0;
+        char magic[sizeof(ckpt_header_t::MAGIC)] = {};
+        if (reader.size() >= sizeof(magic))
+            read_exact(reader, magic, sizeof(magic), 0);
+        if (memcmp(magic, ckpt_header_t::MAGIC, sizeof(magic)) == 0)
+            read_header_v2(reader, header);
+        else
+            read_header_v1(reader, header);
+    } catch (std::runtime_error &e) {
+        ERROR("cannot validate checkpoint header, reason: " << e.what());
+        header.regions.clear();
+        return false;
+    }
+    return true;
+}
 
-        f.exceptions(std::ifstream::failbit | std::ifstream::badbit);
-        f.open(ckpt_name, std::ifstream::in | std::ifstream::binary);
-        size_t no_regions, region_size;
-        int id;
-        f.read((char *)&no_regions, sizeof(size_t));
-        for (unsigned int i = 0; i < no_regions; i++) {
-            f.read((char *)&id, sizeof(int));
-            f.read((char *)&region_size, sizeof(size_t));
-            region_info.insert(std::make_pair(id, region_size));
-            expected_size += region_size;
+static void append(std::string &buffer, const void *ptr, size_t size) {
+    buffer.append((const char *)ptr, size);
+}
+
+static bool extract(const std::string &buffer, size_t &pos, void *ptr, size_t size) {
+    if (pos + size > buffer.size())
+        return false;
+    memcpy(ptr, buffer.data() + pos, size);
+    pos += size;
+    return true;
+}
+
+std::string delta_info_t::serialize() const {
+    std::string buffer;
+    size_t no_regions = regions.size();
+    append(buffer, &base_version, sizeof(int));
+    append(buffer, &no_regions, sizeof(size_t));
+    for (auto &e : regions) {
+        size_t no_runs = e.second.runs.size();
+        append(buffer, &e.first, sizeof(int));
+        append(buffer, &e.second.size, sizeof(size_t));
+        append(buffer, &no_runs, sizeof(size_t));
+        for (auto &r : e.second.runs) {
+            append(buffer, &r.first, sizeof(size_t));
+            append(buffer, &r.second, sizeof(size_t));
         }
-        header_size = f.tellg();
-        f.seekg(0, f.end);
-        size_t file_size = (size_t)f.tellg() - header_size;
-        if (file_size != expected_size)
-            throw std::ifstream::failure("file size " + std::to_string(file_size) + " does not match expected size " + std::to_string(expected_size));
-    } catch (std::ifstream::failure &e) {
-        ERROR("cannot validate header for checkpoint " << ckpt_name << ", reason: " << e.what());
-        header_size = 0;
-    }
-    return header_size;
+    }
+    return buffer;
+}
+
+bool delta_info_t::deserialize(const std::string &buffer) {
+    size_t pos = 0, no_regions, no_runs;
+    regions.clear();
+    if (!extract(buffer, pos, &base_version, sizeof(int)) || !extract(buffer, pos, &no_regions, sizeof(size_t)))
+        return false;
+    for (size_t i = 0; i < no_regions; i++) {
+        int id;
+        region_delta_t region;
+        if (!extract(buffer, pos, &id, sizeof(int)) || !extract(buffer, pos, &region.size, sizeof(size_t))
+            || !extract(buffer, pos, &no_runs, sizeof(size_t)))
+            return false;
+        region.runs.resize(no_runs);
+        for (auto &r : region.runs)
+            if (!extract(buffer, pos, &r.first, sizeof(size_t)) || !extract(buffer, pos, &r.second, sizeof(size_t)))
+                return false;
+        regions.emplace(id, region);
+    }
+    return pos == buffer.size();
+}
+
+std::string compress_info_t::serialize() const {
+    std::string buffer;
+    size_t no_regions = regions.size();
+    append(buffer, &codec, sizeof(int));
+    append(buffer, &block_size, sizeof(size_t));
+    append(buffer, &no_regions, sizeof(size_t));
+    for (auto &e : regions) {
+        size_t no_blocks = e.second.blocks.size();
+        append(buffer, &e.first, sizeof(int));
+        append(buffer, &e.second.size, sizeof(size_t));
+        append(buffer, &no_blocks, sizeof(size_t));
+        append(buffer, e.second.blocks.data(), no_blocks * sizeof(size_t));
+    }
+    return buffer;
+}
+
+bool compress_info_t::deserialize(const std::string &buffer) {
+    size_t pos = 0, no_regions, no_blocks;
+    regions.clear();
+    if (!extract(buffer, pos, &codec, sizeof(int)) || !extract(buffer, pos, &block_size, sizeof(size_t))
+        || !extract(buffer, pos, &no_regions, sizeof(size_t)))
+        return false;
+    for (size_t i = 0; i < no_regions; i++) {
+        int id;
+        region_blocks_t region;
+        if (!extract(buffer, pos, &id, sizeof(int)) || !extract(buffer, pos, &region.size, sizeof(size_t))
+            || !extract(buffer, pos, &no_blocks, sizeof(size_t)) || no_blocks > buffer.size())
+            return false;
+        region.blocks.resize(no_blocks);
+        if (!extract(buffer, pos, region.blocks.data(), no_blocks * sizeof(size_t)))
+            return false;
+        regions.emplace(id, region);
+    }
+    return pos == buffer.size();
+}
+
+static bool read_region(storage_reader_t &reader, const ckpt_header_t &header, int id, std::string &buffer) {
+    auto it = header.regions.find(id);
+    if (it == header.regions.end())
+        return false;
+    buffer.assign(it->second.size, 0);
+    if (!reader.read(buffer.data(), buffer.size(), it->second.offset)) {
+        ERROR("cannot read region " << id << " of checkpoint");
+        return false;
+    }
+    if ((it->second.flags & ckpt_header_t::FLAG_CHKSUM) && update_chksum(0, buffer.data(), buffer.size()) != it->second.chksum) {
+        ERROR("checksum mismatch for region " << id << " of checkpoint");
+        return false;
+    }
+    return true;
+}
+
+bool read_delta_info(storage_reader_t &reader, const ckpt_header_t &header, delta_info_t &delta) {
+    std::string buffer;
+    if (!read_region(reader, header, delta_info_t::REGION_ID, buffer))
+        return false;
+    if (!delta.deserialize(buffer)) {
+        ERROR("incremental checkpoint descriptor is corrupted");
+        return false;
+    }
+    return true;
+}
+
+bool read_compress_info(storage_reader_t &reader, const ckpt_header_t &header, compress_info_t &compress) {
+    std::string buffer;
+    if (!read_region(reader, header, compress_info_t::REGION_ID, buffer))
+        return false;
+    if (!compress.deserialize(buffer)) {
+        ERROR("compression descriptor is corrupted");
+        return false;
+    }
+    return true;
+}
+
+#ifndef WITH_ZLIB
+static uint32_t crc_table[256];
+
+static bool init_crc_table() {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++)
+            c = (c & 1) ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+        crc_table[i] = c;
+    }
+    return true;
+}
+#endif
+
+uint32_t update_chksum(uint32_t crc, const char *ptr, size_t size) {
+#ifdef WITH_ZLIB
+    // zlib takes 32 bit lengths
+    for (size_t done = 0; done < size; ) {
+        uInt len = std::min(size - done, (size_t)1 << 30);
+        crc = crc32(crc, (const Bytef *)ptr + done, len);
+        done += len;
+    }
+    return crc;
+#else
+    static bool initialized = init_crc_table();
+    (void)initialized;
+    crc = ~crc;
+    for (size_t i = 0; i < size; i++)
+        crc = crc_table[(crc ^ (unsigned char)ptr[i]) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+#endif
+}
+
+int compress_codec(const std::string &name) {
+    if (name.empty() || name == "none")
+        return compress_info_t::CODEC_NONE;
+#ifdef WITH_ZLIB
+    if (name == "zlib")
+        return compress_info_t::CODEC_ZLIB;
+#endif
+    return -1;
+}
+
+bool compress_block(int codec, int level, const char *src, size_t size, std::string &dest) {
+    switch (codec) {
+#ifdef WITH_ZLIB
+    case compress_info_t::CODEC_ZLIB: {
+        uLongf dest_size = compressBound(size);
+        dest.resize(dest_size);
+        if (compress2((Bytef *)dest.data(), &dest_size, (const Bytef *)src, size, level) != Z_OK)
+            return false;
+        dest.resize(dest_size);
+        return true;
+    }
+#endif
+    default:
+        return false;
+    }
+}
+
+bool decompress_block(int codec, const char *src, size_t size, char *dest, size_t dest_size) {
+    switch (codec) {
+#ifdef WITH_ZLIB
+    case compress_info_t::CODEC_ZLIB: {
+        uLongf result_size = dest_size;
+        return uncompress((Bytef *)dest, &result_size, (const Bytef *)src, size) == Z_OK && result_size == dest_size;
+    }
+#endif
+    default:
+        return false;
+    }
 }
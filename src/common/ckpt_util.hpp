@@ -2,8 +2,82 @@
 #define __CKPT_UTIL
 
 #include <map>
+#include <vector>
 #include <string>
+#include <limits>
+#include <cstdint>
 
-size_t read_header(const std::string &ckpt_name, std::map<int, size_t> &region_info);
+class storage_reader_t;
+
+// location of a region inside a checkpoint file
+struct region_entry_t {
+    size_t offset = 0, size = 0;
+    uint32_t flags = 0, chksum = 0;
+};
+
+// v1: number of regions followed by (id, size) pairs, the regions are stored back to back at the end of the file
+// v2: magic number, version, alignment and for each region its absolute offset, flags and checksum
+struct ckpt_header_t {
+    static constexpr uint32_t VERSION = 2;
+    static constexpr uint32_t FLAG_CHKSUM = 1;
+    static const char MAGIC[8];
+    uint32_t version = VERSION;
+    size_t alignment = 1;
+    std::map<int, region_entry_t> regions;
+
+    // bytes taken by the header itself
+    size_t size() const;
+    // place the regions one after the other behind the header, each one aligned, returns the resulting file size
+    size_t layout();
+    std::string serialize() const;
+};
+
+// list of (offset, length) byte ranges relative to the start of a memory region
+typedef std::vector<std::pair<size_t, size_t> > region_runs_t;
+
+// descriptor of an incremental checkpoint, stored as a reserved region in front of all others
+struct delta_info_t {
+    static constexpr int REGION_ID = std::numeric_limits<int>::min();
+    struct region_delta_t {
+        size_t size;
+        region_runs_t runs;
+    };
+    int base_version = -1;
+    std::map<int, region_delta_t> regions;
+
+    std::string serialize() const;
+    bool deserialize(const std::string &buffer);
+};
+
+// descriptor of the regions stored in compressed form, each one split into independently compressed blocks
+struct compress_info_t {
+    static constexpr int REGION_ID = std::numeric_limits<int>::min() + 1;
+    static constexpr int CODEC_NONE = 0, CODEC_ZLIB = 1;
+    struct region_blocks_t {
+        size_t size;
+        std::vector<size_t> blocks;
+    };
+    int codec = CODEC_NONE;
+    size_t block_size = 0;
+    std::map<int, region_blocks_t> regions;
+
+    std::string serialize() const;
+    bool deserialize(const std::string &buffer);
+};
+
+inline bool is_reserved_region(int id) {
+    return id == delta_info_t::REGION_ID || id == compress_info_t::REGION_ID;
+}
+
+bool read_header(storage_reader_t &reader, ckpt_header_t &header);
+bool read_delta_info(storage_reader_t &reader, const ckpt_header_t &header, delta_info_t &delta);
+bool read_compress_info(storage_reader_t &reader, const ckpt_header_t &header, compress_info_t &compress);
+
+// CRC-32 of the bytes of a region as stored in the checkpoint file, can be computed piecewise starting from 0
+uint32_t update_chksum(uint32_t crc, const char *ptr, size_t size);
+
+int compress_codec(const std::string &name);
+bool compress_block(int codec, int level, const char *src, size_t size, std::string &dest);
+bool decompress_block(int codec, const char *src, size_t size, char *dest, size_t dest_size);
 
 #endif // __CKPT_UTIL
@@ -0,0 +1,7 @@
+#ifndef __COMM_QUEUE
+#define __COMM_QUEUE
+
+#include "socket_queue.hpp"
+using namespace socket_queue;
+
+#endif
@@ -18,6 +18,17 @@ void command_t::assign_path(const std::string &src) {
     std::strcpy(original, src.c_str());
 }
 
+int command_t::priority() const {
+    switch (command) {
+    case CHECKPOINT:
+        return PRIORITY_FLUSH;
+    case RESTART:
+        return PRIORITY_RESTART;
+    default:
+        return PRIORITY_CONTROL;
+    }
+}
+
 std::string command_t::stem() const {
     return std::string(name) + "-" + std::to_string(unique_id) +
         "-" + std::to_string(version) + ".dat";
@@ -46,6 +57,12 @@ std::string command_t::filename(const std::string &prefix) const {
     return prefix + "/" + stem();
 }
 
+std::string command_t::source(const std::string &prefix) const {
+    if (memfd < 0)
+        return filename(prefix);
+    return "/proc/" + std::to_string(pid) + "/fd/" + std::to_string(memfd);
+}
+
 std::string command_t::meta_filename(const std::string &prefix) const {
     return filename(prefix) + ".chksum";
 }
@@ -61,9 +78,87 @@ std::ostream &operator<<(std::ostream &output, const command_t &c) {
 }
 
 template<typename A> void command_t::save(A& ar) {
-    ar.write(this);
+    // RPCs may be handled out of order, so names are not interned
+    char buf[command_codec_t::MAX_SIZE];
+    size_t size = command_codec_t(false).encode(*this, buf);
+    ar.write(&size);
+    ar.write(buf, size);
 }
 
 template<typename A> void command_t::load(A& ar) {
-    ar.read(this);
+    char buf[command_codec_t::MAX_SIZE];
+    size_t size;
+    ar.read(&size);
+    if (size > command_codec_t::MAX_SIZE) {
+        ERROR("invalid command packet of size " << size);
+        command = INVALID;
+        return;
+    }
+    ar.read(buf, size);
+    if (!command_codec_t(false).decode(buf, size, *this)) {
+        ERROR("cannot decode command packet of size " << size);
+        command = INVALID;
+    }
+}
+
+size_t command_codec_t::encode(const command_t &c, char *buf, uint16_t flags) {
+    header_t h = {c.offset, c.unique_id, c.command, c.version, c.pid, c.memfd, NO_NAME,
+                  (uint16_t)strlen(c.name), (uint16_t)strlen(c.original), flags};
+    if (intern && h.name_len > 0) {
+        auto it = name_ids.find(c.name);
+        if (it != name_ids.end()) {
+            h.name_id = it->second;
+            h.name_len = 0;
+        } else if (name_ids.size() < NO_NAME) {
+            h.name_id = name_ids.size();
+            name_ids.emplace(c.name, h.name_id);
+        }
+    }
+    memcpy(buf, &h, HEADER_SIZE);
+    memcpy(buf + HEADER_SIZE, c.name, h.name_len);
+    memcpy(buf + HEADER_SIZE + h.name_len, c.original, h.original_len);
+    return HEADER_SIZE + h.name_len + h.original_len;
+}
+
+size_t command_codec_t::packet_size(const char *buf) {
+    header_t h;
+    memcpy(&h, buf, HEADER_SIZE);
+    return HEADER_SIZE + h.name_len + h.original_len;
+}
+
+uint16_t command_codec_t::packet_flags(const char *buf) {
+    header_t h;
+    memcpy(&h, buf, HEADER_SIZE);
+    return h.flags;
+}
+
+bool command_codec_t::decode(const char *buf, size_t size, command_t &c) {
+    header_t h;
+    if (size < HEADER_SIZE)
+        return false;
+    memcpy(&h, buf, HEADER_SIZE);
+    if (size != HEADER_SIZE + h.name_len + h.original_len || h.name_len >= command_t::CKPT_NAME_MAX || h.original_len >= PATH_MAX)
+        return false;
+    c.offset = h.offset;
+    c.unique_id = h.unique_id;
+    c.command = h.command;
+    c.version = h.version;
+    c.pid = h.pid;
+    c.memfd = h.memfd;
+    // a name sent along with its index defines that index, otherwise the index refers to a name sent earlier
+    std::string name(buf + HEADER_SIZE, h.name_len);
+    if (h.name_id != NO_NAME) {
+        if (h.name_len > 0) {
+            if (names.size() <= h.name_id)
+                names.resize(h.name_id + 1);
+            names[h.name_id] = name;
+        } else if (h.name_id < names.size())
+            name = names[h.name_id];
+        else
+            return false;
+    }
+    memcpy(c.name, name.c_str(), name.size() + 1);
+    memcpy(c.original, buf + HEADER_SIZE + h.name_len, h.original_len);
+    c.original[h.original_len] = 0;
+    return true;
 }
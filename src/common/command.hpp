@@ -5,15 +5,24 @@
 #include <iostream>
 #include <string.h>
 #include <regex>
+#include <vector>
+#include <unordered_map>
+#include <cstdint>
 
 class command_t {
 public:
-    static const int INIT = 0, CHECKPOINT = 1, RESTART = 2, TEST = 3, STATUS = 4;
+    static const int INIT = 0, CHECKPOINT = 1, RESTART = 2, TEST = 3, STATUS = 4, POLL = 5, ADMIT = 6;
     static const int ID_EC = -1, ID_AGG = -2;
+    // command of a packet that could not be decoded, to be rejected by the receiver
+    static const int INVALID = -1;
+    // scheduling classes of the backend, lower is more urgent
+    static const int PRIORITY_CONTROL = 0, PRIORITY_RESTART = 1, PRIORITY_FLUSH = 2, PRIORITIES = 3;
     static const size_t CKPT_NAME_MAX = 128;
 
     int unique_id, command, version;
     size_t offset = 0;
+    // checkpoint handed over as a sealed memfd of the client process instead of a scratch file
+    int pid = 0, memfd = -1;
     char name[CKPT_NAME_MAX] = {}, original[PATH_MAX] = {};
 
     static std::regex regex(const std::string &cname);
@@ -22,8 +31,10 @@ public:
     command_t();
     command_t(int r, int c, int v, const std::string &src);
     void assign_path(const std::string &src);
+    int priority() const;
     std::string stem() const;
     std::string filename(const std::string &prefix) const;
+    std::string source(const std::string &prefix) const;
     std::string meta_filename(const std::string &prefix) const;
     std::string agg_filename(const std::string &prefix) const;
     friend std::ostream &operator<<(std::ostream &output, const command_t &c);
@@ -31,4 +42,31 @@ public:
     template<typename A> void load(A& ar);
 };
 
+// compact wire format: fixed fields followed by the used part of the strings only. With interning, a name is
+// sent once and referred to by its index afterwards, so the packets of an encoder must be decoded in order by one decoder
+class command_codec_t {
+    struct header_t {
+        uint64_t offset;
+        int32_t unique_id, command, version, pid, memfd;
+        uint16_t name_id, name_len, original_len, flags;
+    };
+    static const uint16_t NO_NAME = UINT16_MAX;
+    bool intern;
+    std::unordered_map<std::string, uint16_t> name_ids;
+    std::vector<std::string> names;
+
+public:
+    static const size_t HEADER_SIZE = sizeof(header_t), MAX_SIZE = HEADER_SIZE + command_t::CKPT_NAME_MAX + PATH_MAX;
+    // transport flags, not part of the command: the result of a tracked command is kept until the client claims it
+    static const uint16_t TRACK = 1;
+
+    command_codec_t(bool _intern = true) : intern(_intern) { }
+    // buf must hold at least MAX_SIZE bytes, returns the size of the packet
+    size_t encode(const command_t &c, char *buf, uint16_t flags = 0);
+    // total size and transport flags of a packet, given its first HEADER_SIZE bytes
+    static size_t packet_size(const char *buf);
+    static uint16_t packet_flags(const char *buf);
+    bool decode(const char *buf, size_t size, command_t &c);
+};
+
 #endif // __COMMAND_HPP
@@ -10,6 +10,7 @@
 
 #include "storage/posix_module.hpp"
 #include "storage/posix_agg_module.hpp"
+#include "storage/dedup_module.hpp"
 
 #ifdef WITH_AXL
 #include "storage/axl_module.hpp"
@@ -84,6 +85,9 @@ config_t::config_t(const std::string &f, bool is_backend) : cfg_file(f) {
                 std::string meta;
                 get_optional("meta", meta);
                 sm = new posix_agg_module_t(scratch, persistent, meta);
+            } else if (get_bool("dedup", false)) {
+                INFO("using POSIX to interact with persistent storage in deduplicated chunk mode, path: " << persistent);
+                sm = new dedup_module_t(scratch, persistent);
             } else {
                 INFO("using POSIX to interact with persistent storage in single file mode, path: " << persistent);
                 sm = new posix_module_t(scratch, persistent);
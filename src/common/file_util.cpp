@@ -1,5 +1,6 @@
 #include "file_util.hpp"
 #include "command.hpp"
+#include "uring.hpp"
 
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -9,6 +10,7 @@
 
 #include <cerrno>
 #include <cstring>
+#include <vector>
 
 //#define __DEBUG
 #include "debug.hpp"
@@ -81,13 +83,114 @@ bool file_transfer_loop(int fs, size_t soff, int fd, size_t doff, size_t remaini
     return success;
 }
 #elif WITH_POSIX_RW
+#ifdef WITH_IO_URING
+// each thread keeps its ring and the transfer buffers registered with it for its whole lifetime
+struct transfer_ring_t {
+    static const size_t BUFF_SIZE = 1 << 22;
+    uring_t ring;
+    unsigned int depth = 0;
+    char *mem = NULL;
+
+    transfer_ring_t() {
+        if (!ring.is_active())
+            return;
+        depth = std::min(4u, ring.get_entries());
+        if (posix_memalign((void **)&mem, 1 << 12, depth * BUFF_SIZE) != 0) {
+            mem = NULL;
+            return;
+        }
+        ring.register_buffers({{mem, depth * BUFF_SIZE}});
+    }
+    ~transfer_ring_t() {
+        ring.unregister();
+        free(mem);
+    }
+    bool is_active() const {
+        return mem != NULL;
+    }
+};
+
+// several buffers are kept in flight, each one alternating between reading a chunk and writing it back
+static bool uring_transfer_loop(transfer_ring_t &tr, int fs, size_t soff, int fd, size_t doff, size_t remaining) {
+    const size_t BUFF_SIZE = transfer_ring_t::BUFF_SIZE;
+    uring_t &ring = tr.ring;
+    char *mem = tr.mem;
+    struct slot_t {
+        size_t pos = 0, len = 0, done = 0;
+        bool writing = false;
+    };
+    std::vector<slot_t> slots(tr.depth);
+    auto submit = [&](unsigned int i) {
+        slot_t &s = slots[i];
+        if (s.writing)
+            return ring.push(io_request_t(fd, true, mem + i * BUFF_SIZE + s.done, s.len - s.done, doff + s.pos + s.done), i);
+        return ring.push(io_request_t(fs, false, mem + i * BUFF_SIZE + s.done, s.len - s.done, soff + s.pos + s.done), i);
+    };
+    size_t next = 0;
+    unsigned int active = 0;
+    bool success = true;
+    auto start_chunk = [&](unsigned int i) {
+        if (!success || next >= remaining)
+            return false;
+        slots[i].pos = next;
+        slots[i].len = std::min(BUFF_SIZE, remaining - next);
+        slots[i].done = 0;
+        slots[i].writing = false;
+        next += slots[i].len;
+        return submit(i);
+    };
+    for (unsigned int i = 0; i < tr.depth; i++)
+        if (start_chunk(i))
+            active++;
+    while (active > 0) {
+        uint64_t i;
+        int res;
+        if (!ring.wait(i, res)) {
+            success = false;
+            break;
+        }
+        slot_t &s = slots[i];
+        if (res < 0 && res != -EINTR && res != -EAGAIN) {
+            errno = -res;
+            success = false;
+        } else if (res == 0) {
+            // nothing transferred would be retried forever
+            errno = s.writing ? EIO : ENODATA;
+            success = false;
+        } else if (res > 0)
+            s.done += res;
+        if (success && s.done == s.len && !s.writing) {
+            s.writing = true;
+            s.done = 0;
+        }
+        if (success && s.done < s.len) {
+            if (submit(i))
+                continue;
+            success = false;
+        }
+        if (!start_chunk(i))
+            active--;
+    }
+    // buffers still in flight after a ring failure cannot be reused safely, the thread falls back to pread/pwrite
+    if (active > 0)
+        tr.mem = NULL;
+    return success;
+}
+#endif
+
 bool file_transfer_loop(int fs, size_t soff, int fd, size_t doff, size_t remaining) {
     const size_t MAX_BUFF_SIZE = 1 << 24;
+#ifdef WITH_IO_URING
+    // one ring per thread, set up on first use; small transfers do not benefit from pipelining
+    static thread_local transfer_ring_t ring;
+    if (ring.is_active() && remaining > MAX_BUFF_SIZE)
+        return uring_transfer_loop(ring, fs, soff, fd, doff, remaining);
+#endif
     bool success = true;
     char *buff = new char[MAX_BUFF_SIZE];
     while (remaining > 0) {
         ssize_t transferred = pread(fs, buff, std::min(MAX_BUFF_SIZE, (size_t)remaining), soff);
-        if (transferred == -1 || pwrite(fd, buff, transferred, doff) != transferred) {
+        if (transferred <= 0 || pwrite(fd, buff, transferred, doff) != transferred) {
             success = false;
             break;
         }
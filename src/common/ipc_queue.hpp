@@ -2,6 +2,7 @@
 #define __IPC_QUEUE_HPP
 
 #include "status.hpp"
+#include "command.hpp"
 #include "file_util.hpp"
 
 #include <boost/interprocess/managed_shared_memory.hpp>
@@ -9,8 +10,11 @@
 #include <boost/interprocess/sync/named_condition.hpp>
 #include <boost/interprocess/sync/named_mutex.hpp>
 #include <boost/interprocess/containers/list.hpp>
+#include <boost/interprocess/containers/vector.hpp>
 
 #include <functional>
+#include <map>
+#include <set>
 using namespace std::placeholders;
 
 //#define __DEBUG
@@ -21,6 +25,7 @@ namespace ipc_queue {
 using namespace boost::interprocess;
 
 typedef std::function<void (int)> completion_t;
+typedef uint64_t ticket_t;
 
 static const size_t IPC_MAX_SIZE = 1 << 20;
 static const std::string IPC_BUFFER = "veloc-ipc-buffer-" + unique_suffix();
@@ -33,23 +38,78 @@ inline void backend_cleanup() {
     named_condition::remove(IPC_COND.c_str());
 }
 
+// commands are stored as compact packets, see command_codec_t
 template<typename T> struct client_queue_t {
-    typedef allocator<T, managed_shared_memory::segment_manager> T_allocator;
-    typedef list<T, T_allocator> list_t;
+    typedef allocator<char, managed_shared_memory::segment_manager> char_allocator;
+    typedef vector<char, char_allocator> packet_t;
+    typedef allocator<packet_t, managed_shared_memory::segment_manager> T_allocator;
+    typedef list<packet_t, T_allocator> list_t;
+    struct result_t {
+        ticket_t ticket;
+        int status;
+    };
+    typedef allocator<result_t, managed_shared_memory::segment_manager> result_allocator;
+    typedef list<result_t, result_allocator> results_t;
 
     interprocess_mutex mutex;
     interprocess_condition cond;
     int status = VELOC_SUCCESS;
     list_t pending, progress;
-    client_queue_t(const T_allocator &alloc) : pending(alloc), progress(alloc) { }
+    // elements are dequeued in the order they were enqueued, so both sides derive the same tickets by counting
+    ticket_t enqueued = 0, dequeued = 0;
+    results_t results;
+    // link in the ready list, only touched with the pending mutex held
+    offset_ptr<client_queue_t> next;
+    bool ready = false;
+    client_queue_t(const T_allocator &alloc) : pending(alloc), progress(alloc), results(alloc) { }
 };
 
+// FIFO of the clients with pending elements, each client is linked at most once
+template<typename T> struct ready_list_t {
+    typedef client_queue_t<T> container_t;
+    offset_ptr<container_t> head, tail;
+
+    bool empty() const {
+        return head == NULL;
+    }
+    void push(container_t *q) {
+        q->next = NULL;
+        q->ready = true;
+        if (tail == NULL)
+            head = q;
+        else
+            tail->next = q;
+        tail = q;
+    }
+    container_t *pop() {
+        container_t *q = head.get();
+        head = q->next;
+        if (head == NULL)
+            tail = NULL;
+        q->ready = false;
+        return q;
+    }
+};
+
+static const char *IPC_READY_LIST = "veloc-ready-list";
+
 template<typename T> class comm_client_t {
     typedef client_queue_t<T> container_t;
     managed_shared_memory segment;
     named_mutex     pending_mutex;
     named_condition pending_cond;
     container_t *data = NULL;
+    ready_list_t<T> *ready = NULL;
+    command_codec_t encoder;
+    // tracked tickets whose result was not claimed yet
+    std::set<ticket_t> tracked;
+
+    typename container_t::results_t::iterator find_result(ticket_t ticket) {
+        auto it = data->results.begin();
+        while (it != data->results.end() && it->ticket != ticket)
+            ++it;
+        return it;
+    }
 
 public:
     comm_client_t(int id) : segment(open_or_create, IPC_BUFFER.c_str(), IPC_MAX_SIZE),
@@ -57,6 +117,7 @@ public:
                             pending_cond(open_or_create, IPC_COND.c_str()) {
         scoped_lock<named_mutex> cond_lock(pending_mutex);
         data = segment.find_or_construct<container_t>(std::to_string(id).c_str())(segment.get_allocator<typename container_t::T_allocator>());
+        ready = segment.find_or_construct<ready_list_t<T> >(IPC_READY_LIST)();
     }
     int wait_completion(bool reset_status = true) {
         scoped_lock<interprocess_mutex> cond_lock(data->mutex);
@@ -74,13 +135,44 @@ public:
         return data->pending.empty() && data->progress.empty();
     }
 
-    void enqueue(const T &e) {
-        // enqueue an element and notify the consumer
+    int wait_ticket(ticket_t ticket) {
+        if (tracked.erase(ticket) == 0)
+            return VELOC_IGNORED;
+        scoped_lock<interprocess_mutex> cond_lock(data->mutex);
+        typename container_t::results_t::iterator it;
+        while ((it = find_result(ticket)) == data->results.end())
+            data->cond.wait(cond_lock);
+        int ret = it->status;
+        data->results.erase(it);
+        DBG("wait ticket " << ticket << " returning: " << ret);
+        return ret;
+    }
+
+    bool check_ticket(ticket_t ticket) {
+        if (tracked.count(ticket) == 0)
+            return true;
+        scoped_lock<interprocess_mutex> cond_lock(data->mutex);
+        return find_result(ticket) != data->results.end();
+    }
+
+    ticket_t enqueue(const T &e, bool track = false) {
+        // enqueue an element, make the client ready if needed and notify the consumer
+        char buf[command_codec_t::MAX_SIZE];
+        size_t size = encoder.encode(e, buf, track ? command_codec_t::TRACK : 0);
+        typename container_t::packet_t packet(buf, buf + size, segment.get_segment_manager());
+        scoped_lock<named_mutex> cond_lock(pending_mutex);
         scoped_lock<interprocess_mutex> queue_lock(data->mutex);
-        data->pending.push_back(e);
+        data->pending.push_back(boost::move(packet));
+        ticket_t ticket = data->enqueued++;
+        if (!data->ready)
+            ready->push(data);
         queue_lock.unlock();
+        cond_lock.unlock();
         pending_cond.notify_one();
-        DBG("enqueued element " << e);
+        if (track)
+            tracked.insert(ticket);
+        DBG("enqueued element " << e << ", ticket: " << ticket);
+        return ticket;
     }
 };
 
@@ -90,24 +182,18 @@ template<typename T> class comm_backend_t {
     managed_shared_memory segment;
     named_mutex     pending_mutex;
     named_condition pending_cond;
+    ready_list_t<T> *ready;
+    // names are interned per client, so each client has its own decoder
+    std::map<container_t *, command_codec_t> decoders;
 
-    container_t *find_non_empty_pending() {
-        for (managed_shared_memory::const_named_iterator it = segment.named_begin(); it != segment.named_end(); ++it) {
-            container_t *result = (container_t *)it->value();
-            if (!result->pending.empty())
-                return result;
-        }
-        return NULL;
-    }
-    void set_completion(container_t *q, const list_iterator_t  &it, int status) {
+    void set_completion(container_t *q, const list_iterator_t  &it, ticket_t ticket, bool track, int status) {
         // delete the element from the progress queue and notify the producer
         scoped_lock<interprocess_mutex> queue_lock(q->mutex);
-        DBG("completed element " << *it << ", status: " << status);
+        DBG("completed element of size " << it->size() << ", ticket: " << ticket << ", status: " << status);
         q->progress.erase(it);
-        if (q->status < 0 || status < 0)
-            q->status = std::min(q->status, status);
-        else
-            q->status = std::max(q->status, status);
+        q->status = combine_status(q->status, status);
+        if (track)
+            q->results.push_back({ticket, status});
         queue_lock.unlock();
         q->cond.notify_one();
     }
@@ -115,20 +201,29 @@ template<typename T> class comm_backend_t {
 public:
     comm_backend_t() : segment(open_or_create, IPC_BUFFER.c_str(), IPC_MAX_SIZE),
                        pending_mutex(open_or_create, IPC_MUTEX.c_str()),
-                       pending_cond(open_or_create, IPC_COND.c_str()) { }
+                       pending_cond(open_or_create, IPC_COND.c_str()) {
+        scoped_lock<named_mutex> cond_lock(pending_mutex);
+        ready = segment.find_or_construct<ready_list_t<T> >(IPC_READY_LIST)();
+    }
     completion_t dequeue_any(T &e) {
-        // wait until at least one pending queue has at least one element
-        container_t *first_found;
+        // wait until at least one client is ready, i.e. has at least one pending element
         scoped_lock<named_mutex> cond_lock(pending_mutex);
-        while ((first_found = find_non_empty_pending()) == NULL)
+        while (ready->empty())
             pending_cond.wait(cond_lock);
+        container_t *first_found = ready->pop();
         // remove the head of the pending queue and move it to the progress queue
         scoped_lock<interprocess_mutex> queue_lock(first_found->mutex);
-        e = first_found->pending.front();
-        first_found->pending.pop_front();
-        first_found->progress.push_back(e);
+        auto &packet = first_found->pending.front();
+        if (!decoders[first_found].decode(packet.data(), packet.size(), e))
+            FATAL("cannot decode command packet of size " << packet.size());
+        bool track = command_codec_t::packet_flags(packet.data()) & command_codec_t::TRACK;
+        ticket_t ticket = first_found->dequeued++;
+        first_found->progress.splice(first_found->progress.end(), first_found->pending, first_found->pending.begin());
+        // round-robin: a client with more pending elements goes to the back of the ready list
+        if (!first_found->pending.empty())
+            ready->push(first_found);
         DBG("dequeued element " << e);
-        return std::bind(&comm_backend_t<T>::set_completion, this, first_found, std::prev(first_found->progress.end()), _1);
+        return std::bind(&comm_backend_t<T>::set_completion, this, first_found, std::prev(first_found->progress.end()), ticket, track, _1);
     }
 };
 
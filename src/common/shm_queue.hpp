@@ -0,0 +1,341 @@
+#ifndef __SHM_QUEUE_HPP
+#define __SHM_QUEUE_HPP
+
+#include "status.hpp"
+#include "command.hpp"
+#include "file_util.hpp"
+
+#include <atomic>
+#include <climits>
+#include <fstream>
+#include <functional>
+#include <vector>
+
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+//#define __DEBUG
+#include "common/debug.hpp"
+
+namespace shm_queue {
+
+typedef std::function<void (int)> completion_t;
+typedef uint64_t ticket_t;
+
+static const std::string SHM_BUFFER = "/veloc-shm-queue-" + unique_suffix();
+// the client keeps at most 64 unclaimed tickets, so a tracked element always finds a free result slot
+static const unsigned int MAX_CLIENTS = 256, RING_SIZE = 16, RESULT_SLOTS = 128, MAX_HARVESTED = 2 * RESULT_SLOTS;
+
+static_assert(std::atomic<uint32_t>::is_always_lock_free && std::atomic<int>::is_always_lock_free,
+              "shm_queue needs lock-free atomics to share them between processes");
+
+inline void backend_cleanup() {
+    shm_unlink(SHM_BUFFER.c_str());
+}
+
+// futexes are not private, they are shared with other processes through the mapping
+static inline void futex_wait(std::atomic<uint32_t> &addr, uint32_t val) {
+    syscall(SYS_futex, &addr, FUTEX_WAIT, val, NULL, NULL, 0);
+}
+
+static inline void futex_wake(std::atomic<uint32_t> &addr, int count) {
+    syscall(SYS_futex, &addr, FUTEX_WAKE, count, NULL, NULL, 0);
+}
+
+// a killed process may linger as a zombie until reaped, it cannot use its ring anymore
+static inline bool is_alive(int pid) {
+    if (kill(pid, 0) == -1 && errno != EPERM)
+        return false;
+    std::ifstream stat("/proc/" + std::to_string(pid) + "/stat");
+    std::string line;
+    if (!std::getline(stat, line))
+        return false;
+    size_t pos = line.rfind(')');
+    return pos == std::string::npos || pos + 2 >= line.size() || (line[pos + 2] != 'Z' && line[pos + 2] != 'X');
+}
+
+// single producer (client), single consumer (backend) ring, all-zero is the initial state of a free slot
+template<typename T> struct ring_t {
+    std::atomic<int> owner;                     // client id + 1, 0 if free
+    std::atomic<int> pid;                       // process attached to the ring, 0 if none
+    std::atomic<int> status;
+    std::atomic<uint32_t> head, tail, completed; // enqueued by the client, dequeued and completed by the backend
+    std::atomic<uint32_t> waiting;              // client sleeps on tail (ring full) or completed
+    char entries[RING_SIZE][command_codec_t::MAX_SIZE]; // compact packets, only the used part is written
+    // results of tracked elements in the slot picked by the client, the ticket of an element is its position
+    // in the ring (head when enqueued)
+    struct {
+        std::atomic<uint32_t> ticket;           // ticket + 1, set once status is valid
+        std::atomic<int> status;
+    } results[RESULT_SLOTS];
+};
+
+template<typename T> struct segment_t {
+    std::atomic<uint32_t> doorbell, sleeping;   // bumped on every enqueue, the backend sleeps on it when idle
+    std::atomic<uint32_t> slots;                // upper bound of the claimed rings
+    ring_t<T> rings[MAX_CLIENTS];
+};
+
+template<typename T> static segment_t<T> *map_segment() {
+    int fd = shm_open(SHM_BUFFER.c_str(), O_CREAT | O_RDWR, 0600);
+    if (fd == -1)
+        FATAL("cannot open shared memory " << SHM_BUFFER << ", error = " << std::strerror(errno));
+    // the backend and all clients truncate to the same size, newly allocated pages are zeroed
+    if (ftruncate(fd, sizeof(segment_t<T>)) == -1)
+        FATAL("cannot truncate shared memory " << SHM_BUFFER << ", error = " << std::strerror(errno));
+    void *ptr = mmap(NULL, sizeof(segment_t<T>), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (ptr == MAP_FAILED)
+        FATAL("cannot map shared memory " << SHM_BUFFER << ", error = " << std::strerror(errno));
+    return (segment_t<T> *)ptr;
+}
+
+template<typename T> class comm_client_t {
+    segment_t<T> *segment;
+    ring_t<T> *data = NULL;
+    command_codec_t encoder;
+    // tracked ticket + 1 whose result is still in flight or in its slot, indexed like the result slots, and
+    // results moved out to free their slot: fixed tables, so that enqueue does not allocate
+    ticket_t tracked[RESULT_SLOTS] = {};
+    struct {
+        ticket_t ticket;                        // ticket + 1, 0 if free
+        int status;
+    } harvested[MAX_HARVESTED] = {};
+
+    bool claim_harvested(ticket_t ticket, int &status) {
+        for (auto &h : harvested)
+            if (h.ticket == ticket + 1) {
+                h.ticket = 0;
+                status = h.status;
+                return true;
+            }
+        return false;
+    }
+
+    bool is_harvested(ticket_t ticket) const {
+        for (auto &h : harvested)
+            if (h.ticket == ticket + 1)
+                return true;
+        return false;
+    }
+
+    void harvest(ticket_t ticket, int status) {
+        // the client bounds its unclaimed tickets, giving up on the oldest result is only a last resort
+        auto *slot = &harvested[0];
+        for (auto &h : harvested)
+            if (h.ticket < slot->ticket)
+                slot = &h;
+        if (slot->ticket != 0)
+            ERROR("more than " << MAX_HARVESTED << " unclaimed results, dropping the result of ticket " << slot->ticket - 1);
+        slot->status = status;
+        slot->ticket = ticket + 1;
+    }
+
+    int find_tracked(ticket_t ticket) const {
+        for (unsigned int i = 0; i < RESULT_SLOTS; i++)
+            if (tracked[i] == ticket + 1)
+                return i;
+        return -1;
+    }
+
+    // a slot stays with its ticket until the result is claimed or moved out, so a ticket still in flight never
+    // shares it with a newer one: only completed results are moved out, the backend is waited for as a last resort
+    unsigned int claim_slot() {
+        while (true) {
+            for (unsigned int i = 0; i < RESULT_SLOTS; i++)
+                if (tracked[i] == 0)
+                    return i;
+            int slot = -1;
+            uint32_t completed = data->completed.load();
+            for (unsigned int i = 0; i < RESULT_SLOTS; i++) {
+                int status;
+                if (fetch_result(tracked[i] - 1, i, status)) {
+                    harvest(tracked[i] - 1, status);
+                    tracked[i] = 0;
+                    slot = i;
+                }
+            }
+            if (slot >= 0)
+                return slot;
+            ERROR("all " << RESULT_SLOTS << " result slots are in flight, waiting for the backend");
+            wait_change(data->completed, completed);
+        }
+    }
+
+    void wait_change(std::atomic<uint32_t> &addr, uint32_t val) {
+        data->waiting.store(1);
+        if (addr.load() == val)
+            futex_wait(addr, val);
+        data->waiting.store(0);
+    }
+
+    bool fetch_result(ticket_t ticket, unsigned int slot, int &status) {
+        auto &r = data->results[slot];
+        if (r.ticket.load() != (uint32_t)(ticket + 1))
+            return false;
+        status = r.status.load();
+        return true;
+    }
+
+    int wait_result(ticket_t ticket, unsigned int slot) {
+        int status;
+        uint32_t completed;
+        while (completed = data->completed.load(), !fetch_result(ticket, slot, status))
+            wait_change(data->completed, completed);
+        return status;
+    }
+
+public:
+    comm_client_t(int id) : segment(map_segment<T>()) {
+        // reuse the ring of the same client id (e.g. after a restart), otherwise claim a free one
+        for (unsigned int i = 0; i < MAX_CLIENTS && data == NULL; i++) {
+            int owner = segment->rings[i].owner.load();
+            if (owner == id + 1 || (owner == 0 && segment->rings[i].owner.compare_exchange_strong(owner, id + 1)))
+                data = &segment->rings[i];
+        }
+        if (data == NULL)
+            FATAL("maximum number of clients (" << MAX_CLIENTS << ") exceeded for shared memory queue " << SHM_BUFFER);
+        // the ring of a client id is only reused once the process attached to it is gone
+        int pid = data->pid.load();
+        if (pid != 0 && is_alive(pid))
+            FATAL("client id " << id << " is already in use by process " << pid << " on shared memory queue " << SHM_BUFFER);
+        if (!data->pid.compare_exchange_strong(pid, getpid()))
+            FATAL("client id " << id << " is already in use by process " << pid << " on shared memory queue " << SHM_BUFFER);
+        uint32_t slot = data - segment->rings + 1, slots = segment->slots.load();
+        while (slots < slot && !segment->slots.compare_exchange_weak(slots, slot));
+    }
+    ~comm_client_t() {
+        // with nothing in flight, the ring can be claimed by another client, otherwise only this id can reuse it
+        bool idle = data->completed.load() == data->head.load(std::memory_order_relaxed);
+        if (idle)
+            data->status.store(VELOC_SUCCESS);
+        data->pid.store(0);
+        if (idle)
+            data->owner.store(0);
+        munmap(segment, sizeof(segment_t<T>));
+    }
+
+    int wait_completion(bool reset_status = true) {
+        uint32_t completed;
+        while ((completed = data->completed.load()) != data->head.load(std::memory_order_relaxed))
+            wait_change(data->completed, completed);
+        int ret = reset_status ? data->status.exchange(VELOC_SUCCESS) : data->status.load();
+        DBG("wait completion returning: " << ret);
+        return ret;
+    }
+
+    bool check_completion() {
+        return data->completed.load() == data->head.load(std::memory_order_relaxed);
+    }
+
+    int wait_ticket(ticket_t ticket) {
+        int ret;
+        if (claim_harvested(ticket, ret))
+            return ret;
+        int slot = find_tracked(ticket);
+        if (slot < 0)
+            return VELOC_IGNORED;
+        ret = wait_result(ticket, slot);
+        tracked[slot] = 0;
+        DBG("wait ticket " << ticket << " returning: " << ret);
+        return ret;
+    }
+
+    bool check_ticket(ticket_t ticket) {
+        int status, slot = find_tracked(ticket);
+        return is_harvested(ticket) || slot < 0 || fetch_result(ticket, slot, status);
+    }
+
+    ticket_t enqueue(const T &e, bool track = false) {
+        uint32_t head = data->head.load(std::memory_order_relaxed), tail;
+        while (head - (tail = data->tail.load()) == RING_SIZE)
+            wait_change(data->tail, tail);
+        // the slot of a tracked element is sent along in the transport flags
+        uint16_t flags = 0;
+        if (track) {
+            unsigned int slot = claim_slot();
+            tracked[slot] = head + 1;
+            flags = command_codec_t::TRACK | slot << 1;
+        }
+        encoder.encode(e, data->entries[head % RING_SIZE], flags);
+        data->head.store(head + 1);
+        // the backend only needs to be woken up if it went to sleep
+        segment->doorbell.fetch_add(1);
+        if (segment->sleeping.load() > 0)
+            futex_wake(segment->doorbell, 1);
+        DBG("enqueued element " << e << ", ticket: " << head);
+        return head;
+    }
+};
+
+template<typename T> class comm_backend_t {
+    segment_t<T> *segment;
+    unsigned int next = 0;
+    // names are interned per client, so each ring has its own decoder
+    std::vector<command_codec_t> decoders;
+
+    ring_t<T> *find_non_empty_pending() {
+        // round-robin over the claimed rings, so that all clients get served
+        unsigned int slots = segment->slots.load();
+        for (unsigned int i = 0; i < slots; i++) {
+            ring_t<T> *result = &segment->rings[(next + i) % slots];
+            if (result->tail.load(std::memory_order_relaxed) != result->head.load()) {
+                next = (next + i + 1) % slots;
+                return result;
+            }
+        }
+        return NULL;
+    }
+
+    static void set_completion(ring_t<T> *q, uint32_t ticket, uint16_t flags, int status) {
+        if (flags & command_codec_t::TRACK) {
+            auto &r = q->results[(flags >> 1) % RESULT_SLOTS];
+            r.status.store(status);
+            r.ticket.store(ticket + 1);
+        }
+        int current = q->status.load();
+        while (!q->status.compare_exchange_weak(current, combine_status(current, status)));
+        q->completed.fetch_add(1);
+        if (q->waiting.load())
+            futex_wake(q->completed, INT_MAX);
+        DBG("completed element, ticket: " << ticket << ", status: " << status);
+    }
+
+public:
+    comm_backend_t() : segment(map_segment<T>()), decoders(MAX_CLIENTS) { }
+    ~comm_backend_t() {
+        munmap(segment, sizeof(segment_t<T>));
+    }
+
+    completion_t dequeue_any(T &e) {
+        // only called by a single thread, sleep until a client rings the doorbell
+        ring_t<T> *first_found;
+        while (true) {
+            uint32_t doorbell = segment->doorbell.load();
+            if ((first_found = find_non_empty_pending()) != NULL)
+                break;
+            segment->sleeping.fetch_add(1);
+            if (segment->doorbell.load() == doorbell)
+                futex_wait(segment->doorbell, doorbell);
+            segment->sleeping.fetch_sub(1);
+        }
+        uint32_t tail = first_found->tail.load(std::memory_order_relaxed);
+        const char *packet = first_found->entries[tail % RING_SIZE];
+        if (!decoders[first_found - segment->rings].decode(packet, command_codec_t::packet_size(packet), e))
+            FATAL("cannot decode command packet of size " << command_codec_t::packet_size(packet));
+        uint16_t flags = command_codec_t::packet_flags(packet);
+        first_found->tail.store(tail + 1);
+        if (first_found->waiting.load())
+            futex_wake(first_found->tail, 1);
+        DBG("dequeued element " << e);
+        return std::bind(&comm_backend_t<T>::set_completion, first_found, tail, flags, std::placeholders::_1);
+    }
+};
+
+};
+
+#endif // __SHM_QUEUE_HPP
@@ -7,13 +7,17 @@
 
 #include <unordered_map>
 #include <functional>
+#include <memory>
 #include <mutex>
 #include <condition_variable>
 #include <thread>
 #include <list>
+#include <deque>
+#include <set>
+#include <map>
 #include <sys/socket.h>
 #include <sys/un.h>
-#include <poll.h>
+#include <sys/epoll.h>
 #include <unistd.h>
 
 //#define __DEBUG
@@ -24,9 +28,11 @@ namespace socket_queue {
 using namespace std::placeholders;
 
 typedef std::function<void (int)> completion_t;
+typedef uint64_t ticket_t;
 
 static const std::string CHANNEL = "/dev/shm/veloc-socket-" + unique_suffix();
-static const int MAX_CLIENTS = 256;
+static const int MAX_EVENTS = 64;
+static const size_t READ_SIZE = 1 << 16;
 
 inline void backend_cleanup() {
     remove(CHANNEL.c_str());
@@ -36,21 +42,81 @@ struct client_queue_t {
     typedef std::list<command_t> list_t;
     int status = VELOC_SUCCESS;
     list_t pending, progress;
-    int fd = -1;
-    bool waiting = false, reset_status = true;
+    int fd = -1;                                // -1 once the client has closed the connection
+    bool waiting = false, reset_status = true, ready = false;
+    // elements are dequeued in the order they arrived, so tickets are derived by counting on both sides
+    ticket_t enqueued = 0, dequeued = 0, wait_ticket = 0;
+    bool waiting_ticket = false;
+    std::set<ticket_t> tracked;
+    std::map<ticket_t, int> results;
+};
+
+// bytes received from a client that do not form a complete packet yet
+struct connection_t {
+    std::string buffer;
+    command_codec_t decoder;
 };
 
 static inline void fatal_comm() {
     FATAL("cannot interact with unix socket: " << CHANNEL << "; error = " << std::strerror(errno));
 }
 
+static inline bool write_all(int fd, const void *buf, size_t size) {
+    // a client that died must not take down the backend with SIGPIPE
+    const char *ptr = (const char *)buf;
+    while (size > 0) {
+        ssize_t ret = send(fd, ptr, size, MSG_NOSIGNAL);
+        if (ret == -1 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            return false;
+        ptr += ret;
+        size -= ret;
+    }
+    return true;
+}
+
+static inline bool read_all(int fd, void *buf, size_t size) {
+    char *ptr = (char *)buf;
+    while (size > 0) {
+        ssize_t ret = read(fd, ptr, size);
+        if (ret == -1 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            return false;
+        ptr += ret;
+        size -= ret;
+    }
+    return true;
+}
+
 template<typename T> class comm_client_t {
     int id, fd;
+    command_codec_t encoder;
+    ticket_t enqueued = 0;
+
+    void send(const command_t &c, uint16_t flags = 0) {
+        char buf[command_codec_t::MAX_SIZE];
+        size_t size = encoder.encode(c, buf, flags);
+        if (!write_all(fd, buf, size))
+            fatal_comm();
+    }
+
+    // status and poll requests carry the ticket + 1 in the offset, 0 stands for all elements
+    int request(int command, int version, uint64_t offset) {
+        command_t c(id, command, version, "");
+        c.offset = offset;
+        send(c);
+        int reply;
+        if (!read_all(fd, &reply, sizeof(reply)))
+            fatal_comm();
+        return reply;
+    }
 
 public:
     comm_client_t(int _id) : id(_id) {
         sockaddr_un addr;
-        if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+        if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1)
             fatal_comm();
         memset(&addr, 0, sizeof(addr));
         addr.sun_family = AF_UNIX;
@@ -58,57 +124,61 @@ public:
         if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == -1)
             fatal_comm();
     }
+    ~comm_client_t() {
+        close(fd);
+    }
 
     int wait_completion(bool reset_status = true) {
-        command_t c(id, command_t::STATUS, reset_status, "");
-        int reply;
-        if (write(fd, &c, sizeof(c)) != sizeof(c))
-            fatal_comm();
-        if (read(fd, &reply, sizeof(reply)) != sizeof(reply))
-            fatal_comm();
-        return reply;
+        return request(command_t::STATUS, reset_status, 0);
     }
 
     bool check_completion() {
-        ERROR("not yet implemented, use ipc_queue instead");
-        return false;
+        return request(command_t::POLL, 0, 0);
     }
 
-    void enqueue(const command_t &c) {
-        if (write(fd, &c, sizeof(c)) != sizeof(c))
-            fatal_comm();
-        DBG("enqueued element " << c);
+    int wait_ticket(ticket_t ticket) {
+        return request(command_t::STATUS, 0, ticket + 1);
+    }
+
+    bool check_ticket(ticket_t ticket) {
+        return request(command_t::POLL, 0, ticket + 1);
+    }
+
+    ticket_t enqueue(const command_t &c, bool track = false) {
+        send(c, track ? command_codec_t::TRACK : 0);
+        DBG("enqueued element " << c << ", ticket: " << enqueued);
+        return enqueued++;
     }
 };
 
 template<typename T> class comm_backend_t {
     typedef client_queue_t container_t;
+    typedef std::shared_ptr<container_t> container_ptr_t;
     typedef typename container_t::list_t::iterator list_iterator_t;
-    std::unordered_map<int, container_t> client_map;
+    // clients of closed connections are dropped from the map, their pending or in progress elements keep them alive
+    std::unordered_map<int, container_ptr_t> client_map;
+    // clients with pending requests in FIFO order, each client is queued at most once
+    std::deque<container_ptr_t> ready;
     std::mutex map_mutex;
     std::condition_variable map_cond;
     int fd;
 
-    container_t *find_non_empty_pending() {
-        // find first client with pending requests
-        for (auto it = client_map.begin(); it != client_map.end(); ++it) {
-            container_t *result = &it->second;
-            if (!result->pending.empty())
-                return result;
-        }
-        return NULL;
-    }
-
-    void set_completion(container_t *q, const list_iterator_t &it, int status) {
+    void set_completion(const container_ptr_t &q, const list_iterator_t &it, ticket_t ticket, int status) {
         // delete the element from the progress queue and notify the producer
         std::unique_lock<std::mutex> lock(map_mutex);
-        DBG("completed element " << *it << ", status: " << status << ", waiting = " << q->waiting);
+        DBG("completed element " << *it << ", ticket: " << ticket << ", status: " << status << ", waiting = " << q->waiting);
         q->progress.erase(it);
-        if (q->status < 0 || status < 0)
-            q->status = std::min(q->status, status);
-        else
-            q->status = std::max(q->status, status);
-        send_wait_reply(q);
+        q->status = combine_status(q->status, status);
+        if (q->tracked.erase(ticket) > 0)
+            q->results[ticket] = status;
+        send_wait_reply(q.get());
+        send_ticket_reply(q.get());
+    }
+
+    // safety check: must be called with unique_lock acquired
+    void send_reply(container_t *q, int reply) {
+        if (q->fd != -1 && !write_all(q->fd, &reply, sizeof(reply)))
+            ERROR("cannot reply to client on unix socket: " << CHANNEL << "; error = " << std::strerror(errno));
     }
 
     // safety check: must be called with unique_lock acquired
@@ -118,59 +188,145 @@ template<typename T> class comm_backend_t {
             if(q->reset_status)
                 q->status = VELOC_SUCCESS;
             q->waiting = false;
-            if (write(q->fd, &reply, sizeof(reply)) != sizeof(reply))
-                fatal_comm();
+            send_reply(q, reply);
         }
     }
 
-    void enqueue(const command_t &e, int sock) {
+    // safety check: must be called with unique_lock acquired
+    void send_ticket_reply(container_t *q) {
+        if (!q->waiting_ticket)
+            return;
+        int reply = VELOC_IGNORED;
+        auto it = q->results.find(q->wait_ticket);
+        if (it != q->results.end()) {
+            reply = it->second;
+            q->results.erase(it);
+        } else if (q->tracked.count(q->wait_ticket) > 0)
+            return;
+        q->waiting_ticket = false;
+        send_reply(q, reply);
+    }
+
+    void enqueue(const command_t &e, uint16_t flags, int sock) {
         std::unique_lock<std::mutex> lock(map_mutex);
-        container_t *q = &client_map[sock];
-        q->fd = sock;
-        if (e.command == command_t::STATUS) {
+        container_ptr_t &q = client_map[sock];
+        if (!q) {
+            q = std::make_shared<container_t>();
+            q->fd = sock;
+        }
+        if (e.command == command_t::POLL) {
+            // answered right away: is the ticket offset - 1 (everything if 0) completed?
+            ticket_t ticket = e.offset - 1;
+            send_reply(q.get(), e.offset > 0 ? q->results.count(ticket) > 0 || q->tracked.count(ticket) == 0
+                                             : q->pending.empty() && q->progress.empty());
+        } else if (e.command == command_t::STATUS && e.offset > 0) {
+            q->waiting_ticket = true;
+            q->wait_ticket = e.offset - 1;
+            send_ticket_reply(q.get());
+        } else if (e.command == command_t::STATUS) {
             q->waiting = true;
             q->reset_status = e.version;
-            send_wait_reply(q);
+            send_wait_reply(q.get());
         } else {
+            if (flags & command_codec_t::TRACK)
+                q->tracked.insert(q->enqueued);
+            q->enqueued++;
             q->pending.push_back(e);
+            if (!q->ready) {
+                q->ready = true;
+                ready.push_back(q);
+            }
             lock.unlock();
             map_cond.notify_one();
         }
     }
 
+    void drop_client(int sock) {
+        std::unique_lock<std::mutex> lock(map_mutex);
+        auto it = client_map.find(sock);
+        if (it != client_map.end()) {
+            it->second->fd = -1;
+            client_map.erase(it);
+        }
+    }
+
+    bool read_client(int sock, connection_t &conn) {
+        // read everything available without blocking, then process the complete packets
+        char buf[READ_SIZE];
+        bool open = true;
+        while (true) {
+            ssize_t ret = recv(sock, buf, READ_SIZE, MSG_DONTWAIT);
+            if (ret > 0)
+                conn.buffer.append(buf, ret);
+            else if (ret == -1 && errno == EINTR)
+                continue;
+            else if (ret == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                break;
+            else {
+                // client has closed connection, maybe died: what it sent before (e.g. a last checkpoint) still counts
+                open = false;
+                break;
+            }
+        }
+        size_t pos = 0;
+        while (conn.buffer.size() - pos >= command_codec_t::HEADER_SIZE) {
+            const char *packet = conn.buffer.data() + pos;
+            size_t size = command_codec_t::packet_size(packet);
+            if (size > command_codec_t::MAX_SIZE) {
+                ERROR("invalid command packet of size " << size << " received on unix socket: " << CHANNEL);
+                return false;
+            }
+            if (conn.buffer.size() - pos < size)
+                break;
+            command_t c;
+            if (!conn.decoder.decode(packet, size, c)) {
+                ERROR("cannot decode command packet of size " << size << " received on unix socket: " << CHANNEL);
+                return false;
+            }
+            enqueue(c, command_codec_t::packet_flags(packet), sock);
+            pos += size;
+        }
+        conn.buffer.erase(0, pos);
+        return open;
+    }
+
     void handle_connections() {
-        pollfd fds[MAX_CLIENTS];
-        fds[0].fd = fd;
-        fds[0].events = POLLIN;
-        int fds_size = 1;
+        int efd = epoll_create1(EPOLL_CLOEXEC);
+        if (efd == -1)
+            fatal_comm();
+        epoll_event ev = {}, events[MAX_EVENTS];
+        ev.events = EPOLLIN;
+        ev.data.fd = fd;
+        if (epoll_ctl(efd, EPOLL_CTL_ADD, fd, &ev) == -1)
+            fatal_comm();
+        std::unordered_map<int, connection_t> connections;
 
         while (true) {
-            int nready = poll(fds, fds_size, -1);
-            DBG("fds_size = " << nready);
+            int nready = epoll_wait(efd, events, MAX_EVENTS, -1);
+            DBG("nready = " << nready);
+            if (nready == -1 && errno == EINTR)
+                continue;
             if (nready == -1)
                 fatal_comm();
-            // loop over all existing client connections
-            for (int i = 1; i < fds_size; i++)
-                if (fds[i].revents & POLLIN) {
-                    command_t c;
-                    if (read(fds[i].fd, &c, sizeof(c)) == sizeof(c))
-                        enqueue(c, fds[i].fd);
-                    else // client has closed connection, maybe died
-                        fds[i].fd = -1;
+            for (int i = 0; i < nready; i++) {
+                int sock = events[i].data.fd;
+                if (sock == fd) {
+                    // accept all new client connections, they stay blocking so that replies are never dropped
+                    int client;
+                    while ((client = accept4(fd, NULL, NULL, SOCK_CLOEXEC)) != -1) {
+                        ev.data.fd = client;
+                        if (epoll_ctl(efd, EPOLL_CTL_ADD, client, &ev) == -1)
+                            fatal_comm();
+                        connections[client];
+                    }
+                    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && errno != ECONNABORTED)
+                        fatal_comm();
+                } else if (!read_client(sock, connections[sock])) {
+                    DBG("closing connection " << sock);
+                    drop_client(sock);
+                    connections.erase(sock);
+                    close(sock);
                 }
-            // check if we have a new client connection
-            if (fds[0].revents & POLLIN) {
-                int client = accept(fd, NULL, NULL);
-                if (client == -1)
-                    fatal_comm();
-                int i = 0;
-                while (i < fds_size && fds[i].fd != -1)
-                    i++;
-                if (i > MAX_CLIENTS)
-                    FATAL("maximum number of clients (" << MAX_CLIENTS << ") exceeded for unix socket: " << CHANNEL);
-                fds[i].fd = client;
-                fds[i].events = POLLIN;
-                fds_size = std::max(fds_size, i + 1);
             }
         }
     }
@@ -178,31 +334,38 @@ template<typename T> class comm_backend_t {
 public:
     comm_backend_t() {
         sockaddr_un addr;
-        if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+        if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) == -1)
             fatal_comm();
         memset(&addr, 0, sizeof(addr));
         addr.sun_family = AF_UNIX;
         std::strcpy(addr.sun_path, CHANNEL.c_str());
         if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) == -1)
             fatal_comm();
-        if (listen(fd, MAX_CLIENTS) == -1)
+        if (listen(fd, SOMAXCONN) == -1)
             fatal_comm();
         std::thread t(&comm_backend_t<T>::handle_connections, this);
         t.detach();
     }
 
     completion_t dequeue_any(T &e) {
-        // wait until at least one pending queue has at least one element
-        container_t *first_found;
+        // wait until at least one client is ready, i.e. has at least one pending element
         std::unique_lock<std::mutex> lock(map_mutex);
-        while ((first_found = find_non_empty_pending()) == NULL)
+        while (ready.empty())
             map_cond.wait(lock);
+        container_ptr_t first_found = ready.front();
+        ready.pop_front();
         // remove the head of the pending queue and move it to the progress queue
         e = first_found->pending.front();
         first_found->pending.pop_front();
         first_found->progress.push_back(e);
+        ticket_t ticket = first_found->dequeued++;
+        // round-robin: a client with more pending elements goes to the back of the ready list
+        if (first_found->pending.empty())
+            first_found->ready = false;
+        else
+            ready.push_back(first_found);
         DBG("dequeued element " << e);
-        return std::bind(&comm_backend_t<T>::set_completion, this, first_found, std::prev(first_found->progress.end()), _1);
+        return std::bind(&comm_backend_t<T>::set_completion, this, first_found, std::prev(first_found->progress.end()), ticket, _1);
     }
 };
 
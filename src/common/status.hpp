@@ -5,4 +5,15 @@
 #define VELOC_FAILURE (-1)
 #define VELOC_IGNORED (-2)
 
+#include <algorithm>
+
+// aggregated status of several commands: a failure wins over anything else, then ignored over success
+inline int combine_status(int a, int b) {
+    if (a == VELOC_FAILURE || b == VELOC_FAILURE)
+        return VELOC_FAILURE;
+    if (a < 0 || b < 0)
+        return std::min(a, b);
+    return std::max(a, b);
+}
+
 #endif // __STATUS_HPP
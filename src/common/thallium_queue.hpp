@@ -24,6 +24,7 @@ using namespace std::chrono_literals;
 namespace tl = thallium;
 
 typedef std::function<void (int)> completion_t;
+typedef uint64_t ticket_t;
 
 static const std::string CHANNEL = "/dev/shm/veloc-thallium-" + unique_suffix();
 static const auto SLEEP_DURATION = 2s;
@@ -44,6 +45,7 @@ template<typename T> class comm_client_t {
     tl::engine engine;
     tl::remote_procedure enqueue_rpc, poll_rpc;
     tl::endpoint server;
+    ticket_t enqueued = 0;
 
 public:
     comm_client_t(int _id) : id(_id),
@@ -76,9 +78,20 @@ public:
         return false;
     }
 
-    void enqueue(const T &e) {
+    // RPCs may be handled out of order, so there is no per element result: a ticket waits for all elements
+    int wait_ticket(ticket_t) {
+        return wait_completion(false);
+    }
+
+    bool check_ticket(ticket_t) {
+        ERROR("not yet implemented, use ipc_queue instead");
+        return false;
+    }
+
+    ticket_t enqueue(const T &e, bool = false) {
         enqueue_rpc.on(server)(e);
         DBG("enqueued element " << e);
+        return enqueued++;
     }
 };
 
@@ -104,16 +117,17 @@ template<typename T> class comm_backend_t {
         std::unique_lock<std::mutex> lock(map_mutex);
         DBG("completed element " << *it << ", status: " << status);
         q->progress.erase(it);
-        if (q->status < 0 || status < 0)
-            q->status = std::min(q->status, status);
-        else
-            q->status = std::max(q->status, status);
+        q->status = combine_status(q->status, status);
     }
 
     void start_engine() {
         tl::engine engine("na+sm://", THALLIUM_SERVER_MODE);
         std::function<void(const tl::request&, const T&)> enqueue_rpc =
             [this](const tl::request &req, const T &e) {
+                if (e.command == command_t::INVALID) {
+                    ERROR("rejecting malformed enqueue request");
+                    return;
+                }
                 std::unique_lock<std::mutex> lock(map_mutex);
                 container_t &c = client_map[e.unique_id];
                 c.pending.push_back(e);
@@ -0,0 +1,275 @@
+#include "uring.hpp"
+
+#include <atomic>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <unistd.h>
+#include <sys/uio.h>
+#ifdef WITH_IO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+//#define __DEBUG
+#include "debug.hpp"
+
+// the length of a single request is a 32 bit field
+static const size_t MAX_REQUEST_SIZE = 1 << 30;
+
+static bool sync_request(const io_request_t &req) {
+    char *buf = req.buf;
+    size_t size = req.size, offset = req.offset;
+    while (size > 0) {
+        ssize_t ret = req.write ? pwrite(req.fd, buf, size, offset) : pread(req.fd, buf, size, offset);
+        if (ret == -1 && errno == EINTR)
+            continue;
+        if (ret <= 0) {
+            ERROR("cannot " << (req.write ? "write " : "read ") << size << " bytes at offset " << offset
+                  << ", error = " << (ret == 0 ? "unexpected end of file" : std::strerror(errno)));
+            return false;
+        }
+        buf += ret;
+        size -= ret;
+        offset += ret;
+    }
+    return true;
+}
+
+uring_t::uring_t(unsigned int n) {
+#ifdef WITH_IO_URING
+    io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    ring_fd = syscall(__NR_io_uring_setup, n, &p);
+    if (ring_fd == -1) {
+        static std::atomic<bool> reported(false);
+        if (!reported.exchange(true))
+            INFO("io_uring not available, falling back to pread/pwrite, error: " << std::strerror(errno));
+        return;
+    }
+    sq_entries = p.sq_entries;
+    sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        sq_ring_size = cq_ring_size = std::max(sq_ring_size, cq_ring_size);
+    sq_ring = mmap(NULL, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+    if (sq_ring == MAP_FAILED) {
+        sq_ring = NULL;
+    } else if (p.features & IORING_FEAT_SINGLE_MMAP)
+        cq_ring = sq_ring;
+    else {
+        cq_ring = mmap(NULL, cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+        if (cq_ring == MAP_FAILED)
+            cq_ring = NULL;
+    }
+    if (cq_ring != NULL) {
+        void *ptr = mmap(NULL, p.sq_entries * sizeof(io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         ring_fd, IORING_OFF_SQES);
+        if (ptr != MAP_FAILED)
+            sqes = (io_uring_sqe *)ptr;
+    }
+    if (sqes == NULL) {
+        ERROR("cannot map io_uring queues, falling back to pread/pwrite, error: " << std::strerror(errno));
+        teardown();
+        return;
+    }
+    char *sq = (char *)sq_ring, *cq = (char *)cq_ring;
+    sq_head = (unsigned int *)(sq + p.sq_off.head);
+    sq_tail = (unsigned int *)(sq + p.sq_off.tail);
+    sq_mask = (unsigned int *)(sq + p.sq_off.ring_mask);
+    sq_array = (unsigned int *)(sq + p.sq_off.array);
+    cq_head = (unsigned int *)(cq + p.cq_off.head);
+    cq_tail = (unsigned int *)(cq + p.cq_off.tail);
+    cq_mask = (unsigned int *)(cq + p.cq_off.ring_mask);
+    cqes = (io_uring_cqe *)(cq + p.cq_off.cqes);
+    entries = p.sq_entries;
+    DBG("io_uring set up with " << entries << " entries");
+#endif
+}
+
+void uring_t::teardown() {
+#ifdef WITH_IO_URING
+    if (ring_fd == -1)
+        return;
+    if (sqes != NULL)
+        munmap(sqes, sq_entries * sizeof(io_uring_sqe));
+    if (cq_ring != NULL && cq_ring != sq_ring)
+        munmap(cq_ring, cq_ring_size);
+    if (sq_ring != NULL)
+        munmap(sq_ring, sq_ring_size);
+    close(ring_fd);
+    ring_fd = -1;
+    sq_ring = cq_ring = NULL;
+    sqes = NULL;
+#endif
+}
+
+uring_t::~uring_t() {
+    teardown();
+}
+
+bool uring_t::register_files(const std::vector<int> &fds) {
+#ifdef WITH_IO_URING
+    if (!is_active())
+        return false;
+    if (!files.empty())
+        syscall(__NR_io_uring_register, ring_fd, IORING_UNREGISTER_FILES, NULL, 0);
+    files.clear();
+    if (syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_FILES, fds.data(), fds.size()) != 0) {
+        DBG("cannot register files, error: " << std::strerror(errno));
+        return false;
+    }
+    files = fds;
+    return true;
+#else
+    return false;
+#endif
+}
+
+bool uring_t::register_buffers(const std::vector<std::pair<char *, size_t> > &bufs) {
+#ifdef WITH_IO_URING
+    if (!is_active())
+        return false;
+    if (!buffers.empty())
+        syscall(__NR_io_uring_register, ring_fd, IORING_UNREGISTER_BUFFERS, NULL, 0);
+    buffers.clear();
+    std::vector<iovec> iov;
+    for (auto &b : bufs)
+        iov.push_back({b.first, b.second});
+    if (syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_BUFFERS, iov.data(), iov.size()) != 0) {
+        DBG("cannot register buffers, error: " << std::strerror(errno));
+        return false;
+    }
+    buffers = bufs;
+    return true;
+#else
+    return false;
+#endif
+}
+
+void uring_t::unregister() {
+#ifdef WITH_IO_URING
+    if (!files.empty())
+        syscall(__NR_io_uring_register, ring_fd, IORING_UNREGISTER_FILES, NULL, 0);
+    if (!buffers.empty())
+        syscall(__NR_io_uring_register, ring_fd, IORING_UNREGISTER_BUFFERS, NULL, 0);
+    files.clear();
+    buffers.clear();
+#endif
+}
+
+bool uring_t::push(const io_request_t &req, uint64_t tag) {
+#ifdef WITH_IO_URING
+    if (!is_active() || queued + in_flight >= entries)
+        return false;
+    unsigned int tail = *sq_tail, index = tail & *sq_mask;
+    size_t size = std::min(req.size, MAX_REQUEST_SIZE);
+    io_uring_sqe *sqe = &sqes[index];
+    memset(sqe, 0, sizeof(io_uring_sqe));
+    auto file = std::find(files.begin(), files.end(), req.fd);
+    if (file != files.end()) {
+        sqe->fd = file - files.begin();
+        sqe->flags = IOSQE_FIXED_FILE;
+    } else
+        sqe->fd = req.fd;
+    auto buffer = std::find_if(buffers.begin(), buffers.end(), [&](const std::pair<char *, size_t> &b) {
+        return req.buf >= b.first && req.buf + size <= b.first + b.second;
+    });
+    if (buffer != buffers.end()) {
+        sqe->opcode = req.write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+        sqe->buf_index = buffer - buffers.begin();
+    } else
+        sqe->opcode = req.write ? IORING_OP_WRITE : IORING_OP_READ;
+    sqe->addr = (uint64_t)req.buf;
+    sqe->len = size;
+    sqe->off = req.offset;
+    sqe->user_data = tag;
+    sq_array[index] = index;
+    __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+    queued++;
+    return true;
+#else
+    return false;
+#endif
+}
+
+bool uring_t::enter(unsigned int submit, unsigned int wait) {
+#ifdef WITH_IO_URING
+    while (true) {
+        int ret = syscall(__NR_io_uring_enter, ring_fd, submit, wait, wait > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if (ret == -1 && errno == EINTR)
+            continue;
+        if (ret == -1 || (ret == 0 && submit > 0 && wait == 0)) {
+            ERROR("cannot submit io_uring requests, error: " << std::strerror(errno));
+            return false;
+        }
+        queued -= ret;
+        in_flight += ret;
+        submit -= ret;
+        if (submit == 0)
+            return true;
+    }
+#else
+    return false;
+#endif
+}
+
+bool uring_t::wait(uint64_t &tag, int &res) {
+#ifdef WITH_IO_URING
+    if (queued > 0 && !enter(queued, 0))
+        return false;
+    while (in_flight > 0) {
+        unsigned int head = *cq_head;
+        if (head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+            io_uring_cqe *cqe = &cqes[head & *cq_mask];
+            tag = cqe->user_data;
+            res = cqe->res;
+            __atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+            in_flight--;
+            return true;
+        }
+        if (!enter(0, 1))
+            return false;
+    }
+#endif
+    return false;
+}
+
+bool uring_t::run(const std::vector<io_request_t> &reqs) {
+    if (!is_active()) {
+        for (auto &req : reqs)
+            if (!sync_request(req))
+                return false;
+        return true;
+    }
+    // progress of each request is tracked in place, failures stop new submissions but drain the ones in flight
+    std::vector<io_request_t> work(reqs);
+    size_t next = 0;
+    bool success = true;
+    while (true) {
+        while (success && next < work.size() && push(work[next], next))
+            next++;
+        uint64_t tag;
+        int res;
+        if (queued + in_flight == 0 || !wait(tag, res))
+            break;
+        io_request_t &req = work[tag];
+        if (res == -EINTR || res == -EAGAIN)
+            res = 0;
+        else if (res <= 0) {
+            ERROR("cannot " << (req.write ? "write " : "read ") << req.size << " bytes at offset " << req.offset
+                  << ", error = " << (res == 0 ? "unexpected end of file" : std::strerror(-res)));
+            success = false;
+            continue;
+        }
+        req.buf += res;
+        req.size -= res;
+        req.offset += res;
+        if (req.size > 0 && !push(req, tag)) {
+            success = false;
+            break;
+        }
+    }
+    return success && next == work.size() && queued + in_flight == 0;
+}
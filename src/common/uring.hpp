@@ -0,0 +1,62 @@
+#ifndef __URING_HPP
+#define __URING_HPP
+
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+
+// single read or write of a contiguous buffer at a given file offset
+struct io_request_t {
+    int fd;
+    bool write;
+    char *buf;
+    size_t size, offset;
+    io_request_t(int f, bool w, char *b, size_t s, size_t o) : fd(f), write(w), buf(b), size(s), offset(o) { }
+};
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+// minimal io_uring engine built directly on the system calls, a ring must only be used by one thread at a time;
+// if io_uring is not available at compile time or at runtime, requests are served using pread/pwrite
+class uring_t {
+    static const unsigned int DEFAULT_ENTRIES = 64;
+
+    int ring_fd = -1;
+    unsigned int entries = 0, sq_entries = 0, queued = 0, in_flight = 0;
+    void *sq_ring = NULL, *cq_ring = NULL;
+    size_t sq_ring_size = 0, cq_ring_size = 0;
+    unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array, *cq_head, *cq_tail, *cq_mask;
+    io_uring_sqe *sqes = NULL;
+    io_uring_cqe *cqes = NULL;
+    // registered files and buffers are looked up by file descriptor and by address
+    std::vector<int> files;
+    std::vector<std::pair<char *, size_t> > buffers;
+
+    bool enter(unsigned int submit, unsigned int wait);
+    void teardown();
+
+public:
+    uring_t(unsigned int entries = DEFAULT_ENTRIES);
+    uring_t(const uring_t &other) = delete;
+    ~uring_t();
+
+    bool is_active() const {
+        return ring_fd != -1;
+    }
+    unsigned int get_entries() const {
+        return entries;
+    }
+    bool register_files(const std::vector<int> &fds);
+    bool register_buffers(const std::vector<std::pair<char *, size_t> > &bufs);
+    void unregister();
+
+    // queue a request, tag is returned with its completion; fails if the submission queue is full
+    bool push(const io_request_t &req, uint64_t tag);
+    // submit the queued requests and wait for the next completion, res is the result of the read/write or -errno
+    bool wait(uint64_t &tag, int &res);
+    // serve all requests keeping up to as many in flight as the ring has entries, short transfers are resumed
+    bool run(const std::vector<io_request_t> &reqs);
+};
+
+#endif // __URING_HPP
@@ -8,19 +8,37 @@
 #include <regex>
 #include <future>
 #include <queue>
+#include <deque>
+#include <tuple>
+#include <algorithm>
 
 #include <unistd.h>
+#include <fcntl.h>
 #include <limits.h>
 #include <stdlib.h>
+#include <sys/mman.h>
 
 //#define __DEBUG
 #include "common/debug.hpp"
 
+static const int DEFAULT_CHAIN = 4;
+static const size_t COMPRESS_BLOCK_SIZE = 1 << 22;
+static const size_t READ_CHUNK_SIZE = 1 << 26;
+static const size_t MAX_TICKETS = 64;
+
 static inline bool validate_name(const std::string &name) {
     std::regex e("[a-zA-Z0-9_\\.]+");
     return std::regex_match(name, e);
 }
 
+// these ids hold the descriptors of incremental and compressed checkpoints
+static inline bool check_region_id(int id) {
+    if (!is_reserved_region(id))
+        return true;
+    ERROR("memory region id " << id << " is reserved by VELOC");
+    return false;
+}
+
 static void launch_backend(const std::string &cfg_file) {
     char *path = getenv("VELOC_BIN");
     std::string command;
@@ -42,8 +60,175 @@ bool client_impl_t::check_threaded() {
     return threaded;
 }
 
+void client_impl_t::init_tracking() {
+    incremental = cfg.get_bool("incremental", false);
+    snapshot = cfg.get_bool("snapshot", false);
+    // the versions skipped by persistent_interval may be the base of a later delta, which is useless without it
+    int interval;
+    if (incremental && cfg.storage() != NULL && cfg.get_optional("persistent_interval", interval) && interval > 0) {
+        INFO("incremental checkpointing is not compatible with persistent_interval, writing full checkpoints");
+        incremental = false;
+    }
+    if (incremental || snapshot)
+        tracker = new page_tracker_t();
+    if (snapshot)
+        INFO("copy-on-write snapshots active, memory regions are written to scratch in the background");
+    if (!incremental)
+        return;
+    if (!cfg.get_optional("incremental_chain", max_chain))
+        max_chain = DEFAULT_CHAIN;
+    // all versions of a chain need to be retained in order to rebuild its latest version
+    int versions;
+    if (cfg.get_optional("scratch_versions", versions) && versions > 0)
+        max_chain = std::min(max_chain, versions - 1);
+    if (cfg.get_optional("max_versions", versions) && versions > 0)
+        max_chain = std::min(max_chain, versions - 1);
+    INFO("incremental checkpointing active, full checkpoint after every " << max_chain << " incremental ones");
+}
+
+void client_impl_t::init_compression() {
+    std::string name;
+    cfg.get_optional("compression", name);
+    codec = compress_codec(name);
+    if (codec < 0)
+        FATAL("compression codec " << name << " is invalid or not available at compile time");
+    if (codec == compress_info_t::CODEC_NONE)
+        return;
+    if (!cfg.get_optional("compression_level", codec_level))
+        codec_level = 1;
+    INFO("compressing memory regions using " << name << ", level = " << codec_level);
+}
+
+void client_impl_t::init_layout() {
+    if (!cfg.get_optional("region_alignment", region_alignment) || region_alignment == 0)
+        region_alignment = 1;
+    // O_DIRECT needs the regions to start at aligned offsets anyway
+    region_alignment = std::max(region_alignment, (unsigned int)region_io.align(1));
+    region_chksum = cfg.get_bool("region_chksum", false);
+    DBG("region alignment = " << region_alignment << ", region checksums = " << region_chksum);
+}
+
+void client_impl_t::init_restart() {
+    lazy_restart = cfg.get_bool("lazy_restart", false);
+    direct_restore = cfg.get_bool("direct_restore", false);
+    restore_cache = cfg.get_bool("direct_restore_cache", true);
+    // opt-in: whole-file checksums cannot be verified when only some regions are read
+    partial_restore = cfg.get_bool("partial_restore", false);
+    collective_restart = cfg.get_bool("collective_restart", false);
+    if (direct_restore && cfg.storage() == NULL)
+        INFO("direct restore requested without persistent storage, restarting from scratch only");
+    // prefetched checkpoints may still be copied to scratch, restart needs to wait for them
+    if (cfg.get_bool("prefetch", false)) {
+        if (direct_restore)
+            INFO("direct restore is not compatible with prefetching, staging checkpoints on scratch instead");
+        direct_restore = partial_restore = collective_restart = false;
+    }
+}
+
+void client_impl_t::init_budget() {
+    unsigned int budget;
+    std::string policy;
+    if (!cfg.get_optional("scratch_budget", budget) || budget == 0)
+        return;
+    // with coalescing, the backend skips superseded flushes instead of holding back the checkpoints
+    throttle = !cfg.get_optional("scratch_policy", policy) || policy != "coalesce";
+}
+
+void client_impl_t::admit_checkpoint(size_t size) {
+    if (!throttle)
+        return;
+    command_t cmd(rank, command_t::ADMIT, current_ckpt.version, current_ckpt.name);
+    cmd.offset = size;
+    TIMER_START(admit_timer);
+    queue->wait_ticket(queue->enqueue(cmd, true));
+    TIMER_STOP(admit_timer, "admitted checkpoint " << current_ckpt.stem() << " of " << size << " bytes on scratch");
+}
+
+void client_impl_t::admit_checkpoint(const regions_t &ckpt_regions) {
+    // serialized regions only know their size once serialized, the header and padding are left out
+    size_t total = 0;
+    for (auto &e : ckpt_regions)
+        total += e.second.size;
+    admit_checkpoint(total);
+}
+
+void client_impl_t::prepare_header(ckpt_header_t &header) {
+    header.alignment = region_alignment;
+    header.layout();
+    for (auto &e : header.regions)
+        e.second.flags = region_chksum ? ckpt_header_t::FLAG_CHKSUM : 0;
+}
+
+bool client_impl_t::verify_region(int id, const char *ptr, size_t size) {
+    auto it = ckpt_header.regions.find(id);
+    if (it == ckpt_header.regions.end() || !(it->second.flags & ckpt_header_t::FLAG_CHKSUM)
+        || update_chksum(0, ptr, size) == it->second.chksum)
+        return true;
+    ERROR("checksum mismatch for region " << id << " of checkpoint file " << current_ckpt);
+    return false;
+}
+
+bool client_impl_t::create_memfd(std::string &fname) {
+    // checkpoint_mem may be called several times for the same checkpoint, each call rewrites the memfd
+    if (current_ckpt.memfd < 0) {
+        int fd = memfd_create(current_ckpt.stem().c_str(), MFD_CLOEXEC | MFD_ALLOW_SEALING);
+        if (fd == -1) {
+            ERROR("cannot create memfd for checkpoint " << current_ckpt << ", error: " << strerror(errno));
+            return false;
+        }
+        current_ckpt.pid = getpid();
+        current_ckpt.memfd = fd;
+    }
+    fname = "/proc/self/fd/" + std::to_string(current_ckpt.memfd);
+    return true;
+}
+
+bool client_impl_t::seal_memfd(int fd) {
+    // the backend reads the memfd while the application moves on, make sure it cannot change anymore
+    if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) == 0)
+        return true;
+    ERROR("cannot seal memfd " << fd << ", error: " << strerror(errno));
+    return false;
+}
+
+void client_impl_t::release_memfds() {
+    // only called once the backend has finished all commands that refer to the memfds
+    for (int fd : pending_memfds)
+        close(fd);
+    pending_memfds.clear();
+    for (auto &t : tickets)
+        release_memfd(t.second);
+}
+
+void client_impl_t::release_memfd(pending_ckpt_t &ckpt) {
+    if (ckpt.memfd < 0)
+        return;
+    close(ckpt.memfd);
+    ckpt.memfd = -1;
+}
+
+int client_impl_t::claim_ticket(tickets_t::iterator it) {
+    int ret = queue->wait_ticket(it->second.ticket);
+    release_memfd(it->second);
+    tickets.erase(it);
+    return ret;
+}
+
+void client_impl_t::untrack_region(const region_t &region) {
+    if (tracker != NULL && region.ptr != NULL) {
+        tracker->release(region.ptr);
+        tracked_owner.erase(region.ptr);
+    }
+}
+
 client_impl_t::client_impl_t(unsigned int id, const std::string &cfg_file) :
-    cfg(cfg_file, false), rank(id) {
+    cfg(cfg_file, false), rank(id), region_io(cfg) {
+    init_tracking();
+    init_compression();
+    init_layout();
+    init_restart();
+    init_budget();
+    memfd = cfg.get_bool("memfd", false);
     if(cfg.is_sync() || check_threaded())
         start_main_loop(cfg, MPI_COMM_NULL);
     else
@@ -54,9 +239,15 @@ client_impl_t::client_impl_t(unsigned int id, const std::string &cfg_file) :
 }
 
 client_impl_t::client_impl_t(MPI_Comm c, const std::string &cfg_file) :
-    cfg(cfg_file, false), comm(c) {
+    cfg(cfg_file, false), comm(c), region_io(cfg) {
     MPI_Comm_rank(comm, &rank);
     MPI_Comm_size(comm, &no_ranks);
+    init_tracking();
+    init_compression();
+    init_layout();
+    init_restart();
+    init_budget();
+    memfd = cfg.get_bool("memfd", false);
     if (cfg.is_sync() || check_threaded()) {
         int provided;
         MPI_Comm_split_type(comm, MPI_COMM_TYPE_SHARED, 0, MPI_INFO_NULL, &local);
@@ -67,6 +258,9 @@ client_impl_t::client_impl_t(MPI_Comm c, const std::string &cfg_file) :
         MPI_Barrier(local);
     } else
         launch_backend(cfg_file);
+    // collective restarts need the ranks of the same node, also when the backend runs in a separate process
+    if (collective_restart && local == MPI_COMM_NULL)
+        MPI_Comm_split_type(comm, MPI_COMM_TYPE_SHARED, 0, MPI_INFO_NULL, &local);
     aggregated = cfg.get_bool("aggregated", false);
     queue = new comm_client_t<command_t>(rank);
     run_blocking(command_t(rank, command_t::INIT, 0, ""));
@@ -76,6 +270,16 @@ client_impl_t::client_impl_t(MPI_Comm c, const std::string &cfg_file) :
 }
 
 client_impl_t::~client_impl_t() {
+    drain_snapshot();
+    drain_cache();
+    // the backend may still be reading the memfds
+    bool memfds = !pending_memfds.empty();
+    for (auto &t : tickets)
+        memfds = memfds || t.second.memfd >= 0;
+    if (memfds) {
+        queue->wait_completion();
+        release_memfds();
+    }
     if (local != MPI_COMM_NULL) {
         MPI_Barrier(local);
         MPI_Comm_free(&local);
@@ -83,22 +287,44 @@ client_impl_t::~client_impl_t() {
     if (backends != MPI_COMM_NULL)
         MPI_Comm_free(&backends);
     delete queue;
+    delete tracker;
     DBG("VELOC finalized");
 }
 
 bool client_impl_t::mem_protect(int id, void *ptr, size_t count, size_t base_size, const std::string &name) {
+    if (!check_region_id(id))
+        return false;
+    drain_snapshot();
+    auto it = mem_regions[name].find(id);
+    if (it != mem_regions[name].end() && it->second.ptr != ptr)
+        untrack_region(it->second);
     return mem_regions[name].insert_or_assign(id, region_t(ptr, count * base_size)).second;
 }
 
 bool client_impl_t::mem_protect(int id, const serializer_t &s, const deserializer_t &d, const std::string &name) {
+    if (!check_region_id(id))
+        return false;
+    drain_snapshot();
+    auto it = mem_regions[name].find(id);
+    if (it != mem_regions[name].end())
+        untrack_region(it->second);
     return mem_regions[name].insert_or_assign(id, region_t(s, d)).second;
 }
 
 bool client_impl_t::mem_unprotect(int id, const std::string &name) {
-    return mem_regions[name].erase(id) > 0;
+    drain_snapshot();
+    auto it = mem_regions[name].find(id);
+    if (it == mem_regions[name].end())
+        return false;
+    untrack_region(it->second);
+    mem_regions[name].erase(it);
+    return true;
 }
 
 void client_impl_t::mem_clear(const std::string &name) {
+    drain_snapshot();
+    for (auto &e : mem_regions[name])
+        untrack_region(e.second);
     mem_regions[name].clear();
 }
 
@@ -107,6 +333,7 @@ bool client_impl_t::register_observer(int type, const observer_t &obs) {
 }
 
 bool client_impl_t::cleanup(const std::string &name) {
+    drain_snapshot();
     parse_dir(cfg.get("scratch"), name, [](const std::string &fname, int, int) {
         remove(fname.c_str());
     });
@@ -118,17 +345,67 @@ bool client_impl_t::checkpoint_wait() {
         ERROR("need to finalize local checkpoint first by calling checkpoint_end()");
         return false;
     }
-    return queue->wait_completion() == VELOC_SUCCESS;
+    bool success = drain_snapshot();
+    // versions skipped in favor of a newer one are ignored, the newest one was persisted
+    int ret = queue->wait_completion();
+    success = (ret == VELOC_SUCCESS || ret == VELOC_IGNORED) && success;
+    release_memfds();
+    // the results of the individual checkpoints were all reported above
+    while (!tickets.empty())
+        claim_ticket(tickets.begin());
+    return success;
 }
 
 bool client_impl_t::checkpoint_finished() {
-    if(cfg.is_sync())
+    if (snapshot_task.valid() && !checkpoint_in_progress) {
+        if (snapshot_task.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+            return false;
+        drain_snapshot();
+    }
+    if(cfg.is_sync()) {
+        release_memfds();
+        return true;
+    }
+    if (checkpoint_in_progress) {
+        ERROR("need to finalize local checkpoint first by calling checkpoint_end()");
+        return false;
+    }
+    if (!queue->check_completion())
+        return false;
+    release_memfds();
+    return true;
+}
+
+bool client_impl_t::checkpoint_wait(const std::string &name, int version) {
+    if (checkpoint_in_progress) {
+        ERROR("need to finalize local checkpoint first by calling checkpoint_end()");
+        return false;
+    }
+    // a pending snapshot always belongs to the last checkpoint, which was not handed over to the backend if it failed
+    if (!drain_snapshot() && name == current_ckpt.name && version == current_ckpt.version)
+        return false;
+    auto it = tickets.find(std::make_pair(name, version));
+    if (it == tickets.end())
         return true;
+    return claim_ticket(it) == VELOC_SUCCESS;
+}
+
+bool client_impl_t::checkpoint_finished(const std::string &name, int version) {
     if (checkpoint_in_progress) {
         ERROR("need to finalize local checkpoint first by calling checkpoint_end()");
         return false;
     }
-    return queue->check_completion();
+    // the snapshot task hands over the last checkpoint and records its ticket
+    if (snapshot_task.valid() && snapshot_task.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+        return false;
+    auto it = tickets.find(std::make_pair(name, version));
+    if (it == tickets.end())
+        return true;
+    if (!queue->check_ticket(it->second.ticket))
+        return false;
+    // the result stays available for checkpoint_wait, but the backend is done with the memfd
+    release_memfd(it->second);
+    return true;
 }
 
 bool client_impl_t::checkpoint(const std::string &name, int version) {
@@ -149,6 +426,13 @@ bool client_impl_t::checkpoint_begin(const std::string &name, int version) {
     }
 
     DBG("called checkpoint_begin");
+    if (!drain_snapshot())
+        ERROR("background write of the previous snapshot failed");
+    // a cached copy must not replace the scratch file of this checkpoint
+    if (!drain_cache())
+        ERROR("cannot cache previously restored checkpoints on scratch");
+    if (!pending_memfds.empty() && (cfg.is_sync() || queue->check_completion()))
+        release_memfds();
     current_ckpt = command_t(rank, command_t::CHECKPOINT, version, name.c_str());
     checkpoint_in_progress = true;
     return true;
@@ -172,42 +456,354 @@ bool client_impl_t::checkpoint_mem(int mode, const std::set<int> &ids) {
         ERROR("empty selection of memory regions to checkpoint, please check protection and/or selective checkpointing primitives");
         return false;
     }
+    std::string fname = current_ckpt.filename(cfg.get("scratch"));
+    // the pages of a lazily restarted region that were not accessed yet are still read from the old file
+    if (lazy_files.erase(fname) > 0)
+        unlink(fname.c_str());
+    if (memfd && !create_memfd(fname))
+        return false;
+    if (!region_io.is_default() || incremental || snapshot || codec != compress_info_t::CODEC_NONE)
+        return write_regions(fname, ckpt_regions);
 
+    // serialized data structures go to the arena first, so that the file can be written front to back
+    std::map<int, size_t> serialized;
+    if (!serialize_regions(ckpt_regions, serialized))
+        return false;
+    admit_checkpoint(ckpt_regions);
+    ckpt_header_t header;
+    for (auto &e : ckpt_regions)
+        header.regions[e.first].size = e.second.size;
+    prepare_header(header);
+    auto region_data = [&](const std::pair<const int, region_t> &e) {
+        return e.second.ptr != NULL ? (const char *)e.second.ptr : arena.data() + serialized[e.first];
+    };
+    if (region_chksum)
+        for (auto &e : ckpt_regions)
+            header.regions[e.first].chksum = update_chksum(0, region_data(e), e.second.size);
     std::ofstream f;
     f.exceptions(std::ofstream::failbit | std::ofstream::badbit);
     try {
-        f.open(current_ckpt.filename(cfg.get("scratch")), std::ofstream::out | std::ofstream::binary | std::ofstream::trunc);
-        size_t regions_size = ckpt_regions.size();
-        size_t header_size = sizeof(size_t) + regions_size * (sizeof(int) + sizeof(size_t));
-        // write data and determine serialized sizes
-        f.seekp(header_size);
+        f.open(fname, std::ofstream::out | std::ofstream::binary | std::ofstream::trunc);
+        std::string h = header.serialize();
+        f.write(h.data(), h.size());
+        for (auto &e : ckpt_regions) {
+            // seeking past the end leaves the alignment padding as a hole
+            f.seekp(header.regions[e.first].offset);
+            f.write(region_data(e), e.second.size);
+        }
+    } catch (std::ofstream::failure &f) {
+        ERROR("cannot write to checkpoint file: " << current_ckpt << ", reason: " << f.what());
+        return false;
+    }
+    return true;
+}
+
+bool client_impl_t::write_regions(const std::string &fname, regions_t &ckpt_regions) {
+    // incremental checkpoints only store the pages modified since the previous version of the same name
+    chain_t &chain = chains[current_ckpt.name];
+    bool use_delta = incremental && chain.version >= 0 && chain.length < max_chain;
+    auto contents = std::make_shared<contents_t>();
+    // a new snapshot can only be taken once the previous one was written
+    if (snapshot && !drain_snapshot())
+        ERROR("background write of the previous snapshot failed");
+    if (!collect_regions(ckpt_regions, use_delta ? chain.version : -1, *contents))
+        return false;
+    if (snapshot) {
+        // tracking for the next version started with the snapshot, the regions are written in the background
+        chain.length = use_delta ? chain.length + 1 : 0;
+        chain.version = current_ckpt.version;
+        snapshot_task = std::async(std::launch::async, [this, fname, contents]() {
+            return write_contents(fname, *contents);
+        });
+        return true;
+    }
+    if (!write_contents(fname, *contents))
+        return false;
+
+    if (incremental) {
+        // start a new tracking epoch for all raw regions included in this version
         for (auto &e : ckpt_regions) {
             region_t &info = e.second;
-            if (info.ptr != NULL)
-                f.write((char *)info.ptr, info.size);
-            else {
-                size_t start = f.tellp();
-                info.s(f);
-                info.size = (size_t)f.tellp() - start;
-            }
+            if (info.ptr == NULL)
+                continue;
+            if (tracker->track(info.ptr, info.size))
+                tracked_owner[info.ptr] = std::make_pair(std::string(current_ckpt.name), current_ckpt.version);
+            else
+                tracked_owner.erase(info.ptr);
         }
-        // write header
-        f.seekp(0);
-        f.write((char *)&regions_size, sizeof(size_t));
+        chain.length = use_delta ? chain.length + 1 : 0;
+        chain.version = current_ckpt.version;
+        DBG("checkpoint " << current_ckpt << " written, incremental = " << use_delta << ", chain length = " << chain.length);
+    }
+    return true;
+}
+
+bool client_impl_t::collect_regions(regions_t &ckpt_regions, int base_version, contents_t &contents) {
+    delta_info_t &delta = contents.delta;
+    if (base_version >= 0) {
+        delta.base_version = base_version;
         for (auto &e : ckpt_regions) {
-            f.write((char *)&(e.first), sizeof(int));
-            f.write((char *)&(e.second.size), sizeof(size_t));
+            region_t &info = e.second;
+            auto it = tracked_owner.find(info.ptr);
+            if (info.ptr == NULL || it == tracked_owner.end() || it->second != std::make_pair(std::string(current_ckpt.name), base_version)
+                || !tracker->is_tracked(info.ptr, info.size))
+                continue;
+            auto &d = delta.regions[e.first];
+            d.size = info.size;
+            tracker->get_dirty(info.ptr, info.size, d.runs);
         }
-    } catch (std::ofstream::failure &f) {
-        ERROR("cannot write to checkpoint file: " << current_ckpt << ", reason: " << f.what());
+    }
+
+    // serialized data structures are buffered first to determine their sizes
+    std::map<int, size_t> serialized;
+    if (!serialize_regions(ckpt_regions, serialized))
         return false;
+    admit_checkpoint(ckpt_regions);
+    for (auto &e : ckpt_regions) {
+        region_t &info = e.second;
+        auto &pieces = contents.regions[e.first];
+        if (info.ptr == NULL) {
+            pieces.emplace_back(arena.data() + serialized[e.first], info.size);
+            continue;
+        }
+        char *ptr = (char *)info.ptr;
+        region_runs_t runs;
+        auto it = delta.regions.find(e.first);
+        if (it != delta.regions.end())
+            runs = it->second.runs;
+        else
+            runs.emplace_back(0, info.size);
+        if (!snapshot) {
+            for (auto &r : runs)
+                pieces.emplace_back(ptr + r.first, r.second);
+            continue;
+        }
+        // only [from, to) is covered by the snapshot, everything else is copied right away
+        size_t from = 0, to = 0;
+        if (tracker->snapshot(ptr, info.size, from, to)) {
+            contents.snapshots.push_back(ptr);
+            if (incremental)
+                tracked_owner[ptr] = std::make_pair(std::string(current_ckpt.name), current_ckpt.version);
+        } else
+            tracked_owner.erase(ptr);
+        auto add_copy = [&](size_t begin, size_t end) {
+            if (begin >= end)
+                return;
+            contents.buffers.emplace_back(ptr + begin, end - begin);
+            pieces.emplace_back(contents.buffers.back().data(), end - begin);
+        };
+        for (auto &r : runs) {
+            size_t begin = r.first, end = r.first + r.second;
+            add_copy(begin, std::min(end, from));
+            if (std::max(begin, from) < std::min(end, to))
+                pieces.emplace_back(ptr + std::max(begin, from), std::min(end, to) - std::max(begin, from), ptr);
+            add_copy(std::max(begin, to), end);
+        }
     }
     return true;
 }
 
+bool client_impl_t::serialize_regions(regions_t &ckpt_regions, std::map<int, size_t> &offsets) {
+    // the arena is reused, any write of the previous checkpoint that refers to it must have completed
+    arena.reset();
+    for (auto &e : ckpt_regions)
+        if (e.second.ptr == NULL && !arena.serialize(e.second.s, offsets[e.first], e.second.size)) {
+            ERROR("cannot serialize protected data structure " << e.first << " of checkpoint " << current_ckpt);
+            return false;
+        }
+    return true;
+}
+
+void client_impl_t::read_pieces(const std::vector<piece_t> &pieces, size_t offset, size_t size, char *dest) {
+    size_t start = 0;
+    for (auto &p : pieces) {
+        size_t from = std::max(offset, start), to = std::min(offset + size, start + p.size);
+        if (from < to) {
+            if (p.key != NULL)
+                tracker->read_snapshot(p.key, p.ptr - (char *)p.key + from - start, to - from, dest + from - offset);
+            else
+                memcpy(dest + from - offset, p.ptr + from - start, to - from);
+        }
+        start += p.size;
+    }
+}
+
+uint32_t client_impl_t::chksum_pieces(const std::vector<piece_t> &pieces, std::string &staging) {
+    uint32_t crc = 0;
+    for (auto &p : pieces) {
+        if (p.key == NULL) {
+            crc = update_chksum(crc, p.ptr, p.size);
+            continue;
+        }
+        // pieces under a snapshot must be checksummed as they were when it was taken
+        staging.resize(std::min(p.size, COMPRESS_BLOCK_SIZE));
+        for (size_t done = 0; done < p.size; done += staging.size()) {
+            size_t size = std::min(staging.size(), p.size - done);
+            tracker->read_snapshot(p.key, p.ptr - (char *)p.key + done, size, staging.data());
+            crc = update_chksum(crc, staging.data(), size);
+        }
+    }
+    return crc;
+}
+
+bool client_impl_t::write_contents(const std::string &fname, contents_t &contents) {
+    delta_info_t &delta = contents.delta;
+    auto &buffers = contents.buffers;
+    bool success = true;
+
+    // full regions are compressed in independent blocks spread over all threads
+    compress_info_t compress;
+    if (codec != compress_info_t::CODEC_NONE) {
+        compress.codec = codec;
+        compress.block_size = COMPRESS_BLOCK_SIZE;
+        // blocks as (region id, offset)
+        std::vector<std::pair<int, size_t> > blocks;
+        for (auto &e : contents.regions) {
+            if (delta.regions.count(e.first) > 0)
+                continue;
+            auto &region = compress.regions[e.first];
+            region.size = 0;
+            for (auto &p : e.second)
+                region.size += p.size;
+            for (size_t done = 0; done < region.size; done += COMPRESS_BLOCK_SIZE)
+                blocks.emplace_back(e.first, done);
+        }
+        std::vector<std::string> compressed(blocks.size()), staging(region_io.get_threads());
+        TIMER_START(compress_timer);
+        success = parallel_for(region_io.get_threads(), blocks.size(), [&](unsigned int id, size_t i) {
+            auto &pieces = contents.regions[blocks[i].first];
+            size_t offset = blocks[i].second, size = std::min(COMPRESS_BLOCK_SIZE, compress.regions[blocks[i].first].size - offset);
+            const char *src = pieces[0].ptr + offset;
+            // regions made of several pieces or under a snapshot are assembled first
+            if (pieces.size() > 1 || pieces[0].key != NULL) {
+                staging[id].resize(size);
+                read_pieces(pieces, offset, size, staging[id].data());
+                src = staging[id].data();
+            }
+            return compress_block(codec, codec_level, src, size, compressed[i]);
+        });
+        TIMER_STOP(compress_timer, "compressed " << blocks.size() << " blocks of checkpoint " << current_ckpt);
+        size_t k = 0;
+        for (auto &e : compress.regions) {
+            auto &pieces = contents.regions[e.first];
+            pieces.clear();
+            for (size_t done = 0; done < e.second.size; done += COMPRESS_BLOCK_SIZE, k++) {
+                e.second.blocks.push_back(compressed[k].size());
+                buffers.push_back(std::move(compressed[k]));
+                pieces.emplace_back(buffers.back().data(), buffers.back().size());
+            }
+        }
+        if (!success)
+            ERROR("cannot compress memory regions of checkpoint " << current_ckpt);
+    }
+
+    if (success) {
+        // descriptors use reserved ids that place them in front of all other regions
+        if (delta.base_version >= 0) {
+            buffers.push_back(delta.serialize());
+            contents.regions[delta_info_t::REGION_ID].emplace_back(buffers.back().data(), buffers.back().size());
+        }
+        if (!compress.regions.empty()) {
+            buffers.push_back(compress.serialize());
+            contents.regions[compress_info_t::REGION_ID].emplace_back(buffers.back().data(), buffers.back().size());
+        }
+
+        ckpt_header_t header;
+        for (auto &e : contents.regions)
+            for (auto &p : e.second)
+                header.regions[e.first].size += p.size;
+        prepare_header(header);
+        if (region_chksum) {
+            std::vector<int> ids;
+            for (auto &e : contents.regions)
+                ids.push_back(e.first);
+            std::vector<std::string> staging(region_io.get_threads());
+            TIMER_START(chksum_timer);
+            parallel_for(region_io.get_threads(), ids.size(), [&](unsigned int id, size_t i) {
+                header.regions[ids[i]].chksum = chksum_pieces(contents.regions[ids[i]], staging[id]);
+                return true;
+            });
+            TIMER_STOP(chksum_timer, "computed checksums of " << ids.size() << " regions of checkpoint " << current_ckpt);
+        }
+
+        io_layout_t layout;
+        std::vector<std::pair<size_t, piece_t> > snapshot_pieces;
+        for (auto &e : contents.regions) {
+            size_t offset = header.regions[e.first].offset;
+            for (auto &p : e.second) {
+                layout.emplace_back(offset, p.size, p.ptr);
+                if (p.key != NULL)
+                    snapshot_pieces.emplace_back(offset, p);
+                offset += p.size;
+            }
+        }
+        std::string h = header.serialize();
+        layout.emplace_back(0, h.size(), h.data());
+        success = region_io.write(fname, layout);
+
+        // pages modified by the application while they were being written are replaced with their snapshot
+        if (success && !snapshot_pieces.empty()) {
+            io_layout_t patch;
+            std::deque<std::string> patch_buffers;
+            for (auto &s : snapshot_pieces) {
+                region_runs_t runs;
+                size_t start = s.second.ptr - (char *)s.second.key;
+                tracker->get_copied(s.second.key, runs);
+                for (auto &r : runs) {
+                    size_t from = std::max(start, r.first), to = std::min(start + s.second.size, r.first + r.second);
+                    if (from >= to)
+                        continue;
+                    patch_buffers.emplace_back(to - from, 0);
+                    tracker->read_snapshot(s.second.key, from, to - from, patch_buffers.back().data());
+                    patch.emplace_back(s.first + from - start, to - from, patch_buffers.back().data());
+                }
+            }
+            DBG("patching " << patch.size() << " ranges modified during snapshot of checkpoint " << current_ckpt);
+            success = region_io.patch(fname, patch);
+        }
+        if (!success)
+            ERROR("cannot write to checkpoint file: " << current_ckpt);
+    }
+
+    for (auto key : contents.snapshots)
+        tracker->release_snapshot(key, incremental);
+    return success;
+}
+
+bool client_impl_t::drain_snapshot() {
+    if (!snapshot_task.valid())
+        return true;
+    bool success = snapshot_task.get();
+    // the chain was advanced when the snapshot was taken, start over with a full checkpoint
+    if (!success)
+        chains.clear();
+    return success;
+}
+
+void client_impl_t::track_ticket(const command_t &cmd, ticket_t ticket) {
+    // the backend keeps the result of each ticket until claimed, bound their number by giving up on the oldest
+    auto key = std::make_pair(std::string(cmd.name), cmd.version);
+    auto it = tickets.find(key);
+    if (it == tickets.end() && tickets.size() >= MAX_TICKETS)
+        it = std::min_element(tickets.begin(), tickets.end(), [](auto &a, auto &b) { return a.second.ticket < b.second.ticket; });
+    if (it != tickets.end())
+        claim_ticket(it);
+    // from now on, the memfd is released along with the ticket
+    int memfd = -1;
+    auto fd = std::find(pending_memfds.begin(), pending_memfds.end(), cmd.memfd);
+    if (cmd.memfd >= 0 && fd != pending_memfds.end()) {
+        memfd = cmd.memfd;
+        pending_memfds.erase(fd);
+    }
+    tickets.emplace(key, pending_ckpt_t{ticket, memfd});
+}
+
 bool client_impl_t::checkpoint_end(bool /*success*/) {
     if (aggregated) {
-        long offset = 0, ckpt_size = file_size(current_ckpt.filename(cfg.get("scratch")));
+        // the size of the local checkpoint is needed to compute the offsets
+        if (!drain_snapshot())
+            return false;
+        long offset = 0, ckpt_size = file_size(current_ckpt.source(cfg.get("scratch")));
         MPI_Exscan(&ckpt_size, &offset, 1, MPI_LONG, MPI_SUM, comm);
         DBG("Rank " << rank << ", offset = " << offset);
         if (rank == 0) {
@@ -221,16 +817,49 @@ bool client_impl_t::checkpoint_end(bool /*success*/) {
         current_ckpt.offset = offset;
     }
     checkpoint_in_progress = false;
-    queue->enqueue(current_ckpt);
+    // the size of a file written by the application is only known once it is complete
+    if (current_ckpt.original[0] != 0)
+        admit_checkpoint(std::max(file_size(current_ckpt.filename(cfg.get("scratch"))), (ssize_t)0));
+    if (current_ckpt.memfd >= 0)
+        pending_memfds.push_back(current_ckpt.memfd);
+    if (snapshot_task.valid()) {
+        // hand over the checkpoint to the backend once the snapshot has been written
+        snapshot_task = std::async(std::launch::async, [this, cmd = current_ckpt, task = std::move(snapshot_task)]() mutable {
+            if (!task.get())
+                return false;
+            if (cmd.memfd >= 0)
+                seal_memfd(cmd.memfd);
+            if (cfg.is_sync()) {
+                queue->enqueue(cmd);
+                return queue->wait_completion() == VELOC_SUCCESS;
+            }
+            track_ticket(cmd, queue->enqueue(cmd, true));
+            return true;
+        });
+    } else {
+        if (current_ckpt.memfd >= 0)
+            seal_memfd(current_ckpt.memfd);
+        if (cfg.is_sync())
+            queue->enqueue(current_ckpt);
+        else
+            track_ticket(current_ckpt, queue->enqueue(current_ckpt, true));
+    }
     auto it = observers.find(VELOC_OBSERVE_CKPT_END);
     if (it != observers.end())
         it->second(current_ckpt.name, current_ckpt.version);
-    return cfg.is_sync() ? queue->wait_completion() == VELOC_SUCCESS : true;
+    if (!cfg.is_sync() || snapshot_task.valid())
+        return true;
+    bool success = queue->wait_completion() == VELOC_SUCCESS;
+    release_memfds();
+    return success;
 }
 
 int client_impl_t::run_blocking(const command_t &cmd) {
+    drain_snapshot();
     queue->enqueue(cmd);
-    return queue->wait_completion();
+    int ret = queue->wait_completion();
+    release_memfds();
+    return ret;
 }
 
 int client_impl_t::restart_test(const std::string &name, int needed_version, int target_rank) {
@@ -254,6 +883,13 @@ std::string client_impl_t::route_file(const std::string &original) {
         current_ckpt.assign_path(std::string(abs_path) + "/" + original);
     else
         current_ckpt.assign_path(original);
+    // files are only available to the application once restored to scratch
+    if (reader != NULL) {
+        reader.reset();
+        cache_pending.clear();
+        if (run_blocking(current_ckpt) != VELOC_SUCCESS)
+            ERROR("cannot restore checkpoint " << current_ckpt << " to scratch");
+    }
     return current_ckpt.filename(cfg.get("scratch"));
 }
 
@@ -273,80 +909,422 @@ bool client_impl_t::restart_begin(const std::string &name, int version, int targ
         return false;
     }
 
+    if (!drain_snapshot())
+        ERROR("background write of the previous snapshot failed");
+    if (!drain_cache())
+        ERROR("cannot cache previously restored checkpoints on scratch");
+    cache_pending.clear();
     int result, end_result;
     current_ckpt = command_t(check_rank(target_rank), command_t::RESTART, version, name.c_str());
-    result = run_blocking(current_ckpt);
+    if (collective_restart && local != MPI_COMM_NULL && cfg.storage() != NULL)
+        restore_node();
+    result = open_restart() ? VELOC_SUCCESS : VELOC_FAILURE;
     if (comm != MPI_COMM_NULL)
         MPI_Allreduce(&result, &end_result, 1, MPI_INT, MPI_LOR, comm);
     else
         end_result = result;
     if (end_result == VELOC_SUCCESS) {
-        header_size = 0;
+        header_valid = false;
+        // recovered memory no longer matches the last version written, next checkpoints need to be full
+        if (incremental) {
+            tracker->release_all();
+            tracked_owner.clear();
+            chains.clear();
+        }
         return true;
     } else
         return false;
 }
 
+void client_impl_t::restore_node() {
+    // the leader restores all checkpoints of the node missing on scratch at once, the ranks then find them there
+    int local_rank, local_size;
+    MPI_Comm_rank(local, &local_rank);
+    MPI_Comm_size(local, &local_size);
+    std::string fname = current_ckpt.filename(cfg.get("scratch"));
+    int req[2] = {access(fname.c_str(), R_OK) == 0 ? -1 : current_ckpt.unique_id, current_ckpt.version};
+    std::vector<int> reqs(local_rank == 0 ? 2 * local_size : 0);
+    MPI_Gather(req, 2, MPI_INT, reqs.data(), 2, MPI_INT, 0, local);
+    if (local_rank == 0) {
+        std::set<std::pair<int, int> > missing;
+        for (int i = 0; i < local_size; i++)
+            if (reqs[2 * i] >= 0)
+                missing.emplace(reqs[2 * i], reqs[2 * i + 1]);
+        std::vector<command_t> cmds;
+        for (auto &m : missing)
+            cmds.push_back(command_t(m.first, command_t::RESTART, m.second, current_ckpt.name));
+        std::vector<bool> restored;
+        TIMER_START(restore_timer);
+        if (!cmds.empty() && !cfg.storage()->restore_batch(cmds, restored))
+            // the ranks of the failed checkpoints try again on their own
+            for (size_t i = 0; i < cmds.size(); i++)
+                if (!restored[i])
+                    unlink(cmds[i].filename(cfg.get("scratch")).c_str());
+        TIMER_STOP(restore_timer, "restored " << cmds.size() << " checkpoints of " << local_size << " local ranks");
+    }
+    MPI_Barrier(local);
+}
+
+bool client_impl_t::open_restart() {
+    reader.reset();
+    std::string fname = current_ckpt.filename(cfg.get("scratch"));
+    if ((direct_restore || partial_restore) && cfg.storage() != NULL && access(fname.c_str(), R_OK) != 0) {
+        reader.reset(cfg.storage()->open_reader(current_ckpt));
+        if (reader != NULL) {
+            DBG("restoring checkpoint " << current_ckpt << " directly from persistent storage, direct = " << direct_restore);
+            if (direct_restore && restore_cache)
+                cache_pending.emplace_back(reader, fname);
+            return true;
+        }
+    }
+    return run_blocking(current_ckpt) == VELOC_SUCCESS;
+}
+
 bool client_impl_t::read_current_header() {
-    header_size = read_header(current_ckpt.filename(cfg.get("scratch")), region_info);
-    return header_size != 0;
+    std::shared_ptr<storage_reader_t> source = reader;
+    if (source == NULL) {
+        auto f = std::make_shared<file_reader_t>(current_ckpt.filename(cfg.get("scratch")));
+        if (f->is_open())
+            source = f;
+    }
+    header_valid = source != NULL && read_header(*source, ckpt_header);
+    delta_info = delta_info_t();
+    compress_info = compress_info_t();
+    if (header_valid && ckpt_header.regions.count(delta_info_t::REGION_ID) > 0
+        && !read_delta_info(*source, ckpt_header, delta_info))
+        header_valid = false;
+    if (header_valid && ckpt_header.regions.count(compress_info_t::REGION_ID) > 0
+        && !read_compress_info(*source, ckpt_header, compress_info))
+        header_valid = false;
+    if (!header_valid)
+        ERROR("cannot read header of checkpoint " << current_ckpt);
+    return header_valid;
+}
+
+bool client_impl_t::read_layout(const std::string &fname, const io_layout_t &layout) {
+    if (reader == NULL)
+        return region_io.read(fname, layout);
+    // large segments are split so that they can be spread over all threads
+    io_layout_t chunks;
+    for (auto &s : layout)
+        for (size_t done = 0; done < s.size; done += READ_CHUNK_SIZE)
+            chunks.emplace_back(s.offset + done, std::min(READ_CHUNK_SIZE, s.size - done), s.ptr + done);
+    TIMER_START(io_timer);
+    bool success = parallel_for(region_io.get_read_threads(), chunks.size(), [&](unsigned int, size_t i) {
+        return reader->read(chunks[i].ptr, chunks[i].size, chunks[i].offset);
+    });
+    TIMER_STOP(io_timer, "read " << layout.size() << " segments of " << current_ckpt << " from persistent storage");
+    return success;
+}
+
+static bool cache_file(storage_reader_t &reader, const std::string &fname) {
+    // the copy is not recognized as a checkpoint version until complete
+    size_t pos = fname.rfind('/') + 1;
+    std::string tmp = fname.substr(0, pos) + "." + fname.substr(pos) + ".tmp";
+    int fd = open(tmp.c_str(), O_CREAT | O_TRUNC | O_WRONLY, 0644);
+    if (fd == -1) {
+        ERROR("cannot open " << tmp << ", error: " << strerror(errno));
+        return false;
+    }
+    std::vector<char> buffer(std::min(reader.size(), READ_CHUNK_SIZE));
+    bool success = true;
+    for (size_t done = 0; success && done < reader.size(); done += buffer.size()) {
+        size_t size = std::min(buffer.size(), reader.size() - done);
+        success = reader.read(buffer.data(), size, done);
+        for (size_t written = 0; success && written < size; ) {
+            ssize_t ret = write(fd, buffer.data() + written, size - written);
+            success = ret > 0;
+            written += ret;
+        }
+    }
+    success &= close(fd) == 0;
+    if (success && rename(tmp.c_str(), fname.c_str()) == 0)
+        return true;
+    ERROR("cannot cache checkpoint file " << fname << " on scratch, error: " << strerror(errno));
+    unlink(tmp.c_str());
+    return false;
+}
+
+bool client_impl_t::drain_cache() {
+    if (!cache_task.valid())
+        return true;
+    return cache_task.get();
 }
 
 size_t client_impl_t::recover_size(int id) {
-    if (header_size == 0)
+    if (!header_valid)
         read_current_header();
-    auto it = region_info.find(id);
-    if (it == region_info.end())
+    if (is_reserved_region(id))
+        return 0;
+    auto d = delta_info.regions.find(id);
+    if (d != delta_info.regions.end())
+        return d->second.size;
+    auto c = compress_info.regions.find(id);
+    if (c != compress_info.regions.end())
+        return c->second.size;
+    auto it = ckpt_header.regions.find(id);
+    if (it == ckpt_header.regions.end())
         return 0;
     else
-        return it->second;
+        return it->second.size;
 }
 
 bool client_impl_t::recover_mem(int mode, const std::set<int> &ids) {
-    if (header_size == 0 && !read_current_header()) {
+    if (!header_valid && !read_current_header()) {
         ERROR("cannot recover in memory mode if header unavailable or corrupted");
         return false;
     }
+    // only selective recoveries read from persistent storage in place, otherwise the checkpoint is staged as usual
+    if (reader != NULL && !direct_restore && mode != VELOC_RECOVER_SOME) {
+        reader.reset();
+        if (run_blocking(current_ckpt) != VELOC_SUCCESS) {
+            ERROR("cannot restore checkpoint " << current_ckpt << " to scratch");
+            return false;
+        }
+    }
+    if (ckpt_header.regions.count(delta_info_t::REGION_ID) > 0)
+        return recover_delta(mode, ids);
+    if (lazy_restart && reader == NULL)
+        return recover_lazy(mode, ids);
+    return recover_regions(mode, ids);
+}
+
+bool client_impl_t::map_region(int fd, void *ptr, const region_entry_t &entry) {
+    static const size_t page_size = sysconf(_SC_PAGESIZE);
+    uintptr_t start = (uintptr_t)ptr, begin = (start + page_size - 1) / page_size * page_size,
+        end = (start + entry.size) / page_size * page_size;
+    size_t offset = entry.offset + begin - start;
+    if (begin >= end || offset % page_size != 0)
+        return false;
+    if (mmap((void *)begin, end - begin, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, offset) == MAP_FAILED) {
+        DBG("cannot map checkpoint file at " << ptr << ", error: " << strerror(errno));
+        return false;
+    }
+    // partial pages at both ends are read right away
+    auto read_all = [fd](char *buf, size_t size, size_t off) {
+        while (size > 0) {
+            ssize_t ret = pread(fd, buf, size, off);
+            if (ret <= 0)
+                return false;
+            buf += ret;
+            size -= ret;
+            off += ret;
+        }
+        return true;
+    };
+    return read_all((char *)start, begin - start, entry.offset)
+        && read_all((char *)end, start + entry.size - end, entry.offset + end - start);
+}
+
+bool client_impl_t::recover_lazy(int mode, const std::set<int> &ids) {
+    std::string fname = current_ckpt.filename(cfg.get("scratch"));
     regions_t &ckpt_regions = get_current_ckpt_regions();
-    try {
-        std::ifstream f;
-        f.exceptions(std::ifstream::failbit | std::ifstream::badbit);
-        f.open(current_ckpt.filename(cfg.get("scratch")), std::ifstream::in | std::ifstream::binary);
-        f.seekg(header_size);
-        for (auto &e : region_info) {
-            bool found = ids.find(e.first) != ids.end();
-            if ((mode == VELOC_RECOVER_SOME && !found) || (mode == VELOC_RECOVER_REST && found)) {
-                f.seekg(e.second, std::ifstream::cur);
-                continue;
-            }
-            auto it = ckpt_regions.find(e.first);
-            if (it == ckpt_regions.end()) {
-                ERROR("no protected memory region defined for id " << e.first);
+    int fd = open(fname.c_str(), O_RDONLY);
+    if (fd == -1) {
+        ERROR("cannot open checkpoint file " << fname << ", error: " << strerror(errno));
+        return false;
+    }
+    // raw regions that start at the same offset within a page in memory and in the file are mapped, the rest is read
+    std::set<int> rest;
+    size_t mapped = 0;
+    for (auto &e : ckpt_header.regions) {
+        bool found = ids.find(e.first) != ids.end();
+        if (is_reserved_region(e.first) || (mode == VELOC_RECOVER_SOME && !found) || (mode == VELOC_RECOVER_REST && found))
+            continue;
+        auto it = ckpt_regions.find(e.first);
+        if (it != ckpt_regions.end() && it->second.ptr != NULL && it->second.size >= e.second.size
+            && compress_info.regions.count(e.first) == 0 && map_region(fd, it->second.ptr, e.second))
+            mapped++;
+        else
+            rest.insert(e.first);
+    }
+    close(fd);
+    if (mapped > 0)
+        lazy_files.insert(fname);
+    DBG("lazy restart of " << current_ckpt << ": " << mapped << " regions mapped, " << rest.size() << " regions read");
+    return rest.empty() || recover_regions(VELOC_RECOVER_SOME, rest);
+}
+
+bool client_impl_t::recover_regions(int mode, const std::set<int> &ids) {
+    // all offsets are known from the header, so the selected regions are read concurrently
+    return read_regions(current_ckpt.filename(cfg.get("scratch")), get_current_ckpt_regions(), mode, ids);
+}
+
+bool client_impl_t::recover_delta(int mode, const std::set<int> &ids) {
+    std::set<int> delta_ids, full_ids;
+    for (auto &e : ckpt_header.regions) {
+        if (is_reserved_region(e.first))
+            continue;
+        bool found = ids.find(e.first) != ids.end();
+        if ((mode == VELOC_RECOVER_SOME && !found) || (mode == VELOC_RECOVER_REST && found))
+            continue;
+        if (delta_info.regions.count(e.first) > 0)
+            delta_ids.insert(e.first);
+        else
+            full_ids.insert(e.first);
+    }
+
+    // rebuild the incrementally stored regions from the base version first (which may be incremental itself)
+    command_t delta_ckpt = current_ckpt;
+    ckpt_header_t header = ckpt_header;
+    delta_info_t delta = delta_info;
+    compress_info_t compress = compress_info;
+    std::shared_ptr<storage_reader_t> delta_reader = reader;
+    current_ckpt.version = delta.base_version;
+    DBG("recovering base version " << current_ckpt.version << " of incremental checkpoint " << delta_ckpt);
+    bool success = open_restart();
+    if (success && !delta_ids.empty()) {
+        header_valid = false;
+        success = recover_mem(VELOC_RECOVER_SOME, delta_ids);
+    }
+    current_ckpt = delta_ckpt;
+    ckpt_header = header;
+    delta_info = delta;
+    compress_info = compress;
+    header_valid = true;
+    reader = delta_reader;
+    if (!success) {
+        ERROR("cannot recover base version " << delta.base_version << " of incremental checkpoint " << current_ckpt);
+        return false;
+    }
+    if (!full_ids.empty() && !recover_regions(VELOC_RECOVER_SOME, full_ids))
+        return false;
+
+    // then apply the modified pages on top of the base version
+    regions_t &ckpt_regions = get_current_ckpt_regions();
+    io_layout_t layout;
+    for (auto id : delta_ids) {
+        region_t &info = ckpt_regions.at(id);
+        auto &d = delta_info.regions[id];
+        if (info.ptr == NULL || info.size < d.size) {
+            ERROR("protected memory region " << id << " cannot hold incremental data of size " << d.size);
+            return false;
+        }
+        size_t pos = ckpt_header.regions[id].offset;
+        for (auto &r : d.runs) {
+            layout.emplace_back(pos, r.second, (char *)info.ptr + r.first);
+            pos += r.second;
+        }
+    }
+    if (!read_layout(current_ckpt.filename(cfg.get("scratch")), layout)) {
+        ERROR("cannot read incremental data from checkpoint file " << current_ckpt);
+        return false;
+    }
+    // the checksum covers the modified pages in the order they are stored
+    for (auto id : delta_ids) {
+        auto &e = ckpt_header.regions[id];
+        if (!(e.flags & ckpt_header_t::FLAG_CHKSUM))
+            continue;
+        uint32_t crc = 0;
+        for (auto &r : delta_info.regions[id].runs)
+            crc = update_chksum(crc, (char *)ckpt_regions.at(id).ptr + r.first, r.second);
+        if (crc != e.chksum) {
+            ERROR("checksum mismatch for incremental region " << id << " of checkpoint file " << current_ckpt);
+            return false;
+        }
+    }
+    return true;
+}
+
+bool client_impl_t::read_regions(const std::string &fname, regions_t &ckpt_regions, int mode, const std::set<int> &ids) {
+    std::deque<std::string> buffers;
+    std::vector<std::pair<region_t *, std::string *> > serialized;
+    // compressed blocks to be inflated after reading: (source, source size, destination, destination size)
+    std::vector<std::tuple<char *, size_t, char *, size_t> > blocks;
+    io_layout_t layout;
+
+    // regions to verify after reading: (id, stored bytes, size)
+    std::vector<std::tuple<int, char *, size_t> > verify;
+    for (auto &e : ckpt_header.regions) {
+        size_t region_offset = e.second.offset, stored_size = e.second.size;
+        bool found = ids.find(e.first) != ids.end();
+        if (is_reserved_region(e.first) || (mode == VELOC_RECOVER_SOME && !found) || (mode == VELOC_RECOVER_REST && found))
+            continue;
+        auto it = ckpt_regions.find(e.first);
+        if (it == ckpt_regions.end()) {
+            ERROR("no protected memory region defined for id " << e.first);
+            return false;
+        }
+        region_t &info = it->second;
+        auto c = compress_info.regions.find(e.first);
+        size_t size = c != compress_info.regions.end() ? c->second.size : stored_size;
+        char *ptr = (char *)info.ptr;
+        if (ptr != NULL) {
+            if (info.size < size) {
+                ERROR("protected memory region " << e.first << " is too small ("
+                      << info.size << ") to hold required size ("
+                      << size << ")");
                 return false;
             }
-            region_t &info = it->second;
-            if (info.ptr != NULL) { // direct read of raw data
-                if (info.size < e.second) {
-                    ERROR("protected memory region " << e.first << " is too small ("
-                          << info.size << ") to hold required size ("
-                          << e.second << ")");
-                    return false;
-                }
-                f.read((char *)info.ptr, e.second);
-            } else { // deserialize
-                if (!info.d(f)) {
-                    ERROR("protected data structure " << e.first << " could not be deserialized");
-                    return false;
-                }
-            }
+        } else {
+            buffers.emplace_back(size, 0);
+            serialized.emplace_back(&info, &buffers.back());
+            ptr = buffers.back().data();
+        }
+        if (c == compress_info.regions.end()) {
+            layout.emplace_back(region_offset, stored_size, ptr);
+            verify.emplace_back(e.first, ptr, stored_size);
+            continue;
+        }
+        buffers.emplace_back(stored_size, 0);
+        char *src = buffers.back().data();
+        layout.emplace_back(region_offset, stored_size, src);
+        verify.emplace_back(e.first, src, stored_size);
+        size_t total = 0;
+        for (auto block : c->second.blocks)
+            total += block;
+        if (compress_info.block_size == 0 || total != stored_size
+            || c->second.blocks.size() != (size + compress_info.block_size - 1) / compress_info.block_size) {
+            ERROR("compression descriptor of region " << e.first << " in checkpoint file " << current_ckpt << " is inconsistent");
+            return false;
+        }
+        for (size_t i = 0; i < c->second.blocks.size(); i++) {
+            size_t done = i * compress_info.block_size;
+            blocks.emplace_back(src, c->second.blocks[i], ptr + done, std::min(compress_info.block_size, size - done));
+            src += c->second.blocks[i];
         }
-    } catch (std::ifstream::failure &e) {
-        ERROR("cannot read checkpoint file " << current_ckpt << ", reason: " << e.what());
+    }
+    if (!read_layout(fname, layout)) {
+        ERROR("cannot read checkpoint file " << current_ckpt);
+        return false;
+    }
+    if (!parallel_for(region_io.get_read_threads(), verify.size(), [&](unsigned int, size_t i) {
+        return verify_region(std::get<0>(verify[i]), std::get<1>(verify[i]), std::get<2>(verify[i]));
+    }))
         return false;
+    if (!blocks.empty()) {
+        TIMER_START(decompress_timer);
+        if (!parallel_for(region_io.get_read_threads(), blocks.size(), [&](unsigned int, size_t i) {
+            auto &b = blocks[i];
+            return decompress_block(compress_info.codec, std::get<0>(b), std::get<1>(b), std::get<2>(b), std::get<3>(b));
+        })) {
+            ERROR("cannot decompress memory regions of checkpoint file " << current_ckpt);
+            return false;
+        }
+        TIMER_STOP(decompress_timer, "decompressed " << blocks.size() << " blocks of checkpoint " << current_ckpt);
+    }
+    for (auto &b : serialized) {
+        span_streambuf_t sb(b.second->data(), b.second->size());
+        std::istream in(&sb);
+        if (!b.first->d(in)) {
+            ERROR("protected data structure could not be deserialized from checkpoint file " << current_ckpt);
+            return false;
+        }
     }
     return true;
 }
 
 bool client_impl_t::restart_end(bool /*success*/) {
+    reader.reset();
+    // checkpoints restored directly are copied to scratch in the background for subsequent restarts
+    if (!cache_pending.empty()) {
+        cache_task = std::async(std::launch::async, [files = std::move(cache_pending)]() {
+            bool success = true;
+            for (auto &f : files)
+                success &= cache_file(*f.first, f.second);
+            return success;
+        });
+        cache_pending.clear();
+    }
     return true;
 }
@@ -7,9 +7,14 @@
 #include "common/command.hpp"
 #include "common/comm_queue.hpp"
 #include "modules/module_manager.hpp"
+#include "region_io.hpp"
+#include "region_stream.hpp"
+#include "page_tracker.hpp"
 
 #include <unordered_map>
 #include <map>
+#include <deque>
+#include <future>
 
 class client_impl_t : public veloc::client_t {
     struct region_t {
@@ -23,6 +28,24 @@ class client_impl_t : public veloc::client_t {
     using regions_t = std::map<int, region_t>;
     using regions_map_t = std::unordered_map<std::string, regions_t>;
     using observers_t = std::map<int, observer_t>;
+    // last version written under a checkpoint name and the number of incremental checkpoints since the last full one
+    struct chain_t {
+        int version = -1, length = 0;
+    };
+    // piece of the data of a region, key is set if it points into a region under a copy-on-write snapshot
+    struct piece_t {
+        char *ptr;
+        size_t size;
+        void *key;
+        piece_t(char *p, size_t s, void *k = NULL) : ptr(p), size(s), key(k) { }
+    };
+    // everything needed to write a checkpoint once the regions were collected
+    struct contents_t {
+        std::deque<std::string> buffers;
+        std::map<int, std::vector<piece_t> > regions;
+        std::vector<void *> snapshots;
+        delta_info_t delta;
+    };
 
     config_t cfg;
     MPI_Comm comm = MPI_COMM_NULL, local = MPI_COMM_NULL, backends = MPI_COMM_NULL;
@@ -34,13 +57,84 @@ class client_impl_t : public veloc::client_t {
     command_t current_ckpt;
     bool checkpoint_in_progress = false, aggregated = false;
 
-    std::map<int, size_t> region_info;
-    size_t header_size = 0;
+    ckpt_header_t ckpt_header;
+    delta_info_t delta_info;
+    compress_info_t compress_info;
+    bool header_valid = false;
     comm_client_t<command_t> *queue = NULL;
+    region_io_t region_io;
+    // serialized regions of the current checkpoint
+    arena_streambuf_t arena;
+
+    bool incremental = false, snapshot = false;
+    int max_chain = 0;
+    page_tracker_t *tracker = NULL;
+    std::unordered_map<std::string, chain_t> chains;
+    std::map<void *, std::pair<std::string, int> > tracked_owner;
+    int codec = compress_info_t::CODEC_NONE, codec_level = 1;
+    // background write of the last snapshot, which also hands the checkpoint over to the backend: it uses queue,
+    // region_io and tickets without locking, so every entry point that touches them drains it first
+    std::future<bool> snapshot_task;
+    bool memfd = false;
+    std::vector<int> pending_memfds;
+    bool region_chksum = false;
+    unsigned int region_alignment = 1;
+    // scratch files mapped into protected memory regions by lazy restarts, they must not be truncated
+    bool lazy_restart = false;
+    std::set<std::string> lazy_files;
+    // checkpoint read in place from persistent storage instead of scratch during a direct restore
+    bool direct_restore = false, restore_cache = true, partial_restore = false;
+    // checkpoints missing on scratch are restored by one leader per node on behalf of all its ranks
+    bool collective_restart = false;
+    std::shared_ptr<storage_reader_t> reader;
+    std::vector<std::pair<std::shared_ptr<storage_reader_t>, std::string> > cache_pending;
+    std::future<bool> cache_task;
+    // checkpoints wait for room in the scratch budget of the backend before they are written
+    bool throttle = false;
+    // backend tickets of the asynchronous checkpoints whose result was not claimed yet, along with the memfd
+    // the backend reads the checkpoint from (if any), which is closed as soon as the ticket is known to be complete
+    struct pending_ckpt_t {
+        ticket_t ticket;
+        int memfd;
+    };
+    typedef std::map<std::pair<std::string, int>, pending_ckpt_t> tickets_t;
+    tickets_t tickets;
 
     bool check_threaded();
+    void init_tracking();
+    void init_compression();
+    void init_layout();
+    void init_restart();
+    void init_budget();
+    void admit_checkpoint(size_t size);
+    void admit_checkpoint(const regions_t &ckpt_regions);
+    void prepare_header(ckpt_header_t &header);
+    bool verify_region(int id, const char *ptr, size_t size);
+    void untrack_region(const region_t &region);
+    bool create_memfd(std::string &fname);
+    bool seal_memfd(int fd);
+    void release_memfds();
+    void release_memfd(pending_ckpt_t &ckpt);
+    int claim_ticket(tickets_t::iterator it);
     int run_blocking(const command_t &cmd);
+    void restore_node();
+    bool open_restart();
     bool read_current_header();
+    bool read_layout(const std::string &fname, const io_layout_t &layout);
+    bool drain_cache();
+    bool write_regions(const std::string &fname, regions_t &ckpt_regions);
+    bool serialize_regions(regions_t &ckpt_regions, std::map<int, size_t> &offsets);
+    bool collect_regions(regions_t &ckpt_regions, int base_version, contents_t &contents);
+    void read_pieces(const std::vector<piece_t> &pieces, size_t offset, size_t size, char *dest);
+    uint32_t chksum_pieces(const std::vector<piece_t> &pieces, std::string &staging);
+    bool write_contents(const std::string &fname, contents_t &contents);
+    bool drain_snapshot();
+    void track_ticket(const command_t &cmd, ticket_t ticket);
+    bool read_regions(const std::string &fname, regions_t &ckpt_regions, int mode, const std::set<int> &ids);
+    bool recover_regions(int mode, const std::set<int> &ids);
+    bool map_region(int fd, void *ptr, const region_entry_t &entry);
+    bool recover_lazy(int mode, const std::set<int> &ids);
+    bool recover_delta(int mode, const std::set<int> &ids);
 
     int check_rank(int target_rank) {
         return target_rank < 0 ? rank : target_rank;
@@ -72,6 +166,8 @@ public:
     virtual bool checkpoint_end(bool success);
     virtual bool checkpoint_wait();
     virtual bool checkpoint_finished();
+    virtual bool checkpoint_wait(const std::string &name, int version);
+    virtual bool checkpoint_finished(const std::string &name, int version);
 
     virtual int restart_test(const std::string &name, int version, int target_rank);
     virtual bool restart(const std::string &name, int version, int target_rank);
@@ -0,0 +1,362 @@
+#include "page_tracker.hpp"
+
+#include <atomic>
+#include <mutex>
+#include <map>
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <signal.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+//#define __DEBUG
+#include "common/debug.hpp"
+
+// the fault handler cannot allocate or lock, so the tracked ranges live in a fixed table
+struct tracked_range_t {
+    std::atomic<uintptr_t> begin;
+    uintptr_t end;
+    void *key;
+    size_t size;
+    unsigned char *dirty;
+    // copy-on-write snapshot: original contents of the pages written to since it was taken
+    std::atomic<char *> shadow;
+    std::atomic<unsigned char> *copied;
+    std::atomic<unsigned int> handlers;
+};
+
+// entry of the index searched by the fault handler, sorted by begin
+struct range_entry_t {
+    uintptr_t begin, end;
+    tracked_range_t *range;
+};
+
+static const size_t MAX_RANGES = 1 << 14;
+static tracked_range_t ranges[MAX_RANGES];
+// two copies of the index: the fault handler searches the published one, updates are made to the other one
+// once no handler is searching it anymore and then published in turn
+static range_entry_t index_copies[2][MAX_RANGES];
+static size_t index_sizes[2];
+static std::atomic<int> published(0);
+static std::atomic<unsigned int> searching[2];
+static size_t page_size = 0;
+static struct sigaction old_action;
+// everything below is only used with the mutex held, never by the fault handler
+static std::mutex tracker_mutex;
+static unsigned int tracker_users = 0;
+static std::vector<range_entry_t> range_index;
+static std::map<void *, tracked_range_t *> range_keys;
+static std::vector<tracked_range_t *> free_ranges;
+static size_t used_ranges = 0;
+static bool overflow_reported = false;
+// faulting address already retried by this thread, static TLS is safe to use in the fault handler
+static thread_local uintptr_t retried_addr __attribute__((tls_model("initial-exec"))) = 0;
+
+static tracked_range_t *search_range(uintptr_t addr, uintptr_t &begin) {
+    int current;
+    while (true) {
+        // announce the search before checking the copy is still published: the next update waits for it
+        current = published.load();
+        searching[current]++;
+        if (published.load() == current)
+            break;
+        searching[current]--;
+    }
+    const range_entry_t *first = index_copies[current], *last = first + index_sizes[current];
+    const range_entry_t *e = std::upper_bound(first, last, addr, [](uintptr_t a, const range_entry_t &r) {
+        return a < r.begin;
+    });
+    tracked_range_t *r = NULL;
+    if (e != first && addr < (e - 1)->end) {
+        r = (e - 1)->range;
+        begin = (e - 1)->begin;
+    }
+    searching[current]--;
+    return r;
+}
+
+static void fault_handler(int signum, siginfo_t *info, void *context) {
+    uintptr_t addr = (uintptr_t)info->si_addr, begin = 0;
+    tracked_range_t *r = search_range(addr, begin);
+    if (r != NULL) {
+        // announce the handler before checking the range again: release_range clears begin before waiting
+        // for the handlers, so either it sees this one or this one sees the range is gone
+        r->handlers++;
+        if (r->begin.load() != begin || addr >= r->end) {
+            // released meanwhile, which made its pages writable again: retry the access
+            r->handlers--;
+            return;
+        }
+        size_t page = (addr - begin) / page_size;
+        char *shadow = r->shadow.load();
+        if (shadow != NULL && r->copied[page].load() == 0) {
+            memcpy(shadow + page * page_size, (void *)(begin + page * page_size), page_size);
+            r->copied[page].store(1);
+        }
+        r->dirty[page] = 1;
+        bool success = mprotect((void *)(begin + page * page_size), page_size, PROT_READ | PROT_WRITE) == 0;
+        r->handlers--;
+        retried_addr = 0;
+        if (success)
+            return;
+    }
+    // the range may have been released between the fault and the lookup, which made its pages writable
+    // again: retry the access once before concluding it was not ours
+    if (r == NULL && info->si_code == SEGV_ACCERR && retried_addr != addr) {
+        retried_addr = addr;
+        return;
+    }
+    retried_addr = 0;
+    // not a tracked page: hand over to whoever was there before us
+    if (old_action.sa_flags & SA_SIGINFO)
+        old_action.sa_sigaction(signum, info, context);
+    else if (old_action.sa_handler == SIG_DFL || old_action.sa_handler == SIG_IGN)
+        sigaction(SIGSEGV, &old_action, NULL);
+    else
+        old_action.sa_handler(signum);
+}
+
+static void publish_index() {
+    int next = 1 - published.load();
+    while (searching[next].load() > 0)
+        sched_yield();
+    std::copy(range_index.begin(), range_index.end(), index_copies[next]);
+    index_sizes[next] = range_index.size();
+    published.store(next);
+}
+
+static void index_range(tracked_range_t *r) {
+    range_entry_t entry = {r->begin.load(), r->end, r};
+    auto it = std::upper_bound(range_index.begin(), range_index.end(), entry, [](const range_entry_t &a, const range_entry_t &b) {
+        return a.begin < b.begin;
+    });
+    range_index.insert(it, entry);
+    range_keys[r->key] = r;
+    publish_index();
+}
+
+static void unindex_range(tracked_range_t *r, uintptr_t begin) {
+    auto it = std::lower_bound(range_index.begin(), range_index.end(), begin, [](const range_entry_t &e, uintptr_t b) {
+        return e.begin < b;
+    });
+    while (it->range != r)
+        ++it;
+    range_index.erase(it);
+    range_keys.erase(r->key);
+    publish_index();
+}
+
+static tracked_range_t *allocate_range() {
+    if (!free_ranges.empty()) {
+        tracked_range_t *r = free_ranges.back();
+        free_ranges.pop_back();
+        return r;
+    }
+    if (used_ranges < MAX_RANGES)
+        return &ranges[used_ranges++];
+    if (!overflow_reported) {
+        overflow_reported = true;
+        ERROR("cannot track more than " << MAX_RANGES << " memory regions, the other ones are written in full");
+    }
+    return NULL;
+}
+
+static tracked_range_t *find_range(void *ptr) {
+    auto it = range_keys.find(ptr);
+    return it == range_keys.end() ? NULL : it->second;
+}
+
+static void release_shadow(tracked_range_t *r) {
+    char *shadow = r->shadow.exchange(NULL);
+    if (shadow == NULL)
+        return;
+    // wait for fault handlers that may still be copying into the shadow
+    while (r->handlers.load() > 0)
+        sched_yield();
+    munmap(shadow, r->end - r->begin.load());
+    delete []r->copied;
+    r->copied = NULL;
+}
+
+static void release_range(tracked_range_t *r) {
+    uintptr_t begin = r->begin.load();
+    mprotect((void *)begin, r->end - begin, PROT_READ | PROT_WRITE);
+    release_shadow(r);
+    r->begin.store(0);
+    while (r->handlers.load() > 0)
+        sched_yield();
+    delete []r->dirty;
+    r->dirty = NULL;
+    unindex_range(r, begin);
+    free_ranges.push_back(r);
+}
+
+page_tracker_t::page_tracker_t() {
+    std::unique_lock<std::mutex> lock(tracker_mutex);
+    if (tracker_users++ > 0)
+        return;
+    page_size = sysconf(_SC_PAGESIZE);
+    struct sigaction action;
+    action.sa_sigaction = fault_handler;
+    action.sa_flags = SA_SIGINFO | SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(SIGSEGV, &action, &old_action) != 0)
+        FATAL("cannot install page fault handler, error: " << strerror(errno));
+}
+
+page_tracker_t::~page_tracker_t() {
+    release_all();
+    std::unique_lock<std::mutex> lock(tracker_mutex);
+    if (--tracker_users == 0)
+        sigaction(SIGSEGV, &old_action, NULL);
+}
+
+bool page_tracker_t::track(void *ptr, size_t size) {
+    std::unique_lock<std::mutex> lock(tracker_mutex);
+    return protect(ptr, size, false);
+}
+
+bool page_tracker_t::snapshot(void *ptr, size_t size, size_t &from, size_t &to) {
+    std::unique_lock<std::mutex> lock(tracker_mutex);
+    if (!protect(ptr, size, true))
+        return false;
+    tracked_range_t *r = find_range(ptr);
+    from = r->begin.load() - (uintptr_t)ptr;
+    to = r->end - (uintptr_t)ptr;
+    return true;
+}
+
+bool page_tracker_t::protect(void *ptr, size_t size, bool cow) {
+    uintptr_t begin = ((uintptr_t)ptr + page_size - 1) / page_size * page_size,
+        end = ((uintptr_t)ptr + size) / page_size * page_size;
+    if (begin >= end)
+        return false;
+    tracked_range_t *r = find_range(ptr);
+    if (r != NULL && r->size != size) {
+        release_range(r);
+        r = NULL;
+    }
+    if (r == NULL) {
+        r = allocate_range();
+        if (r == NULL)
+            return false;
+        r->end = end;
+        r->key = ptr;
+        r->size = size;
+        r->dirty = new unsigned char[(end - begin) / page_size];
+        r->begin.store(begin, std::memory_order_release);
+        index_range(r);
+    }
+    size_t pages = (end - begin) / page_size;
+    memset(r->dirty, 0, pages);
+    release_shadow(r);
+    if (cow) {
+        // the shadow is only backed by memory for the pages that actually get copied
+        void *shadow = mmap(NULL, end - begin, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (shadow == MAP_FAILED) {
+            ERROR("cannot allocate snapshot area of size " << end - begin << ", error: " << strerror(errno));
+            release_range(r);
+            return false;
+        }
+        r->copied = new std::atomic<unsigned char>[pages]();
+        r->shadow.store((char *)shadow);
+    }
+    if (mprotect((void *)begin, end - begin, PROT_READ) != 0) {
+        ERROR("cannot write-protect memory region at " << ptr << ", error: " << strerror(errno));
+        release_range(r);
+        return false;
+    }
+    return true;
+}
+
+void page_tracker_t::release(void *ptr) {
+    std::unique_lock<std::mutex> lock(tracker_mutex);
+    tracked_range_t *r = find_range(ptr);
+    if (r != NULL)
+        release_range(r);
+}
+
+void page_tracker_t::release_all() {
+    std::unique_lock<std::mutex> lock(tracker_mutex);
+    while (!range_keys.empty())
+        release_range(range_keys.begin()->second);
+}
+
+void page_tracker_t::release_snapshot(void *ptr, bool keep_tracking) {
+    std::unique_lock<std::mutex> lock(tracker_mutex);
+    tracked_range_t *r = find_range(ptr);
+    if (r == NULL)
+        return;
+    if (keep_tracking)
+        release_shadow(r);
+    else
+        release_range(r);
+}
+
+bool page_tracker_t::is_tracked(void *ptr, size_t size) const {
+    std::unique_lock<std::mutex> lock(tracker_mutex);
+    tracked_range_t *r = find_range(ptr);
+    return r != NULL && r->size == size;
+}
+
+void page_tracker_t::get_dirty(void *ptr, size_t size, region_runs_t &runs) const {
+    auto add_run = [&runs](size_t offset, size_t length) {
+        if (length == 0)
+            return;
+        if (!runs.empty() && runs.back().first + runs.back().second == offset)
+            runs.back().second += length;
+        else
+            runs.emplace_back(offset, length);
+    };
+    runs.clear();
+    std::unique_lock<std::mutex> lock(tracker_mutex);
+    tracked_range_t *r = find_range(ptr);
+    if (r == NULL || r->size != size) {
+        add_run(0, size);
+        return;
+    }
+    uintptr_t start = (uintptr_t)ptr, begin = r->begin.load();
+    add_run(0, begin - start);
+    for (size_t i = 0; i < (r->end - begin) / page_size; i++)
+        if (r->dirty[i])
+            add_run(begin + i * page_size - start, page_size);
+    add_run(r->end - start, start + size - r->end);
+}
+
+void page_tracker_t::get_copied(void *ptr, region_runs_t &runs) const {
+    runs.clear();
+    std::unique_lock<std::mutex> lock(tracker_mutex);
+    tracked_range_t *r = find_range(ptr);
+    if (r == NULL || r->shadow.load() == NULL)
+        return;
+    uintptr_t begin = r->begin.load();
+    for (size_t i = 0; i < (r->end - begin) / page_size; i++)
+        if (r->copied[i].load()) {
+            size_t offset = begin + i * page_size - (uintptr_t)ptr;
+            if (!runs.empty() && runs.back().first + runs.back().second == offset)
+                runs.back().second += page_size;
+            else
+                runs.emplace_back(offset, page_size);
+        }
+}
+
+void page_tracker_t::read_snapshot(void *ptr, size_t offset, size_t size, char *dest) const {
+    std::unique_lock<std::mutex> lock(tracker_mutex);
+    tracked_range_t *r = find_range(ptr);
+    char *shadow = r != NULL ? r->shadow.load() : NULL;
+    lock.unlock();
+    memcpy(dest, (char *)ptr + offset, size);
+    if (shadow == NULL)
+        return;
+    // a page still marked as not copied after reading it could not have been modified in the meantime
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    uintptr_t begin = r->begin.load(), start = (uintptr_t)ptr + offset;
+    for (uintptr_t page = std::max(begin, start) / page_size * page_size; page < std::min(r->end, start + size); page += page_size)
+        if (r->copied[(page - begin) / page_size].load()) {
+            uintptr_t from = std::max(page, start), to = std::min(page + page_size, start + size);
+            memcpy(dest + (from - start), shadow + (from - begin), to - from);
+        }
+}
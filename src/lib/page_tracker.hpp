@@ -0,0 +1,34 @@
+#ifndef __PAGE_TRACKER_HPP
+#define __PAGE_TRACKER_HPP
+
+#include "common/ckpt_util.hpp"
+
+#include <cstddef>
+
+// tracks writes to memory regions at page granularity by write-protecting them and catching the faults
+class page_tracker_t {
+    bool protect(void *ptr, size_t size, bool cow);
+
+public:
+    page_tracker_t();
+    ~page_tracker_t();
+
+    // (re)start tracking: all pages are considered clean from this point on. Fails if the region does not cover a
+    // whole page or too many regions are tracked already, in which case it needs to be written in full
+    bool track(void *ptr, size_t size);
+    // same as track, but also preserves the original contents of written pages until the snapshot is released,
+    // [from, to) is the protected part of the region, the partial pages at its edges are not covered
+    bool snapshot(void *ptr, size_t size, size_t &from, size_t &to);
+    void release_snapshot(void *ptr, bool keep_tracking);
+    void release(void *ptr);
+    void release_all();
+    bool is_tracked(void *ptr, size_t size) const;
+    // dirty byte ranges of the region, partial pages at the edges are always included
+    void get_dirty(void *ptr, size_t size, region_runs_t &runs) const;
+    // pages copied since the snapshot was taken, relative to the start of the region
+    void get_copied(void *ptr, region_runs_t &runs) const;
+    // contents of the region as of the snapshot (or current contents if there is none)
+    void read_snapshot(void *ptr, size_t offset, size_t size, char *dest) const;
+};
+
+#endif // __PAGE_TRACKER_HPP
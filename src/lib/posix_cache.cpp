@@ -67,7 +67,7 @@ static void async_write() {
             if (!result)
                 ERROR("async write failed, error = " << std::strerror(errno));
             std::unique_lock<std::mutex> lock(static_context.async_mutex);
-            static_context.fail_status |= result;
+            static_context.fail_status |= !result;
             static_context.async_op_size -= cmd.size;
         } else
             FATAL("internal async thread error: opcode " << cmd.op << " not recognized");
@@ -0,0 +1,223 @@
+#include "region_io.hpp"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+//#define __DEBUG
+#include "common/debug.hpp"
+
+static bool pwrite_all(int fd, const char *buf, size_t count, size_t offset) {
+    while (count > 0) {
+        ssize_t written = pwrite(fd, buf, count, offset);
+        if (written == -1)
+            return false;
+        buf += written;
+        count -= written;
+        offset += written;
+    }
+    return true;
+}
+
+static ssize_t pread_all(int fd, char *buf, size_t count, size_t offset) {
+    size_t total = 0;
+    while (total < count) {
+        ssize_t br = pread(fd, buf + total, count - total, offset + total);
+        if (br == -1)
+            return -1;
+        if (br == 0)
+            break;
+        total += br;
+    }
+    return total;
+}
+
+static io_layout_t split_chunks(const io_layout_t &layout, size_t chunk_size) {
+    // split large segments into chunks so that they can be spread over all threads
+    io_layout_t chunks;
+    for (auto &s : layout)
+        for (size_t done = 0; done < s.size; done += chunk_size)
+            chunks.emplace_back(s.offset + done, std::min(chunk_size, s.size - done), s.ptr + done);
+    return chunks;
+}
+
+region_io_t::region_io_t(const config_t &cfg) {
+    if (!cfg.get_optional("io_threads", threads) || threads == 0)
+        threads = 1;
+    if (!cfg.get_optional("restart_threads", read_threads) || read_threads == 0)
+        read_threads = threads;
+    direct = cfg.get_bool("direct_io", false);
+    if (cfg.get_bool("io_uring", false)) {
+        ring = new uring_t();
+        if (!ring->is_active()) {
+            delete ring;
+            ring = NULL;
+        }
+    }
+    DBG("region I/O threads = " << threads << ", restart threads = " << read_threads << ", direct = " << direct << ", io_uring = " << (ring != NULL));
+}
+
+region_io_t::~region_io_t() {
+    delete ring;
+    for (auto buff : buffers)
+        free(buff);
+}
+
+int region_io_t::open_file(const std::string &fname, int flags) {
+    int fd = -1;
+    if (direct) {
+        fd = open(fname.c_str(), flags | O_DIRECT, 0644);
+        if (fd == -1 && errno == EINVAL)
+            INFO("file system does not support O_DIRECT, falling back to buffered I/O for " << fname);
+    }
+    if (fd == -1)
+        fd = open(fname.c_str(), flags, 0644);
+    if (fd == -1)
+        ERROR("cannot open " << fname << ", error = " << std::strerror(errno));
+    return fd;
+}
+
+template <typename F> bool region_io_t::run_parallel(unsigned int workers, size_t items, F f) {
+    unsigned int workers_no = std::max((size_t)1, std::min((size_t)workers, items));
+    if (direct)
+        while (buffers.size() < workers_no) {
+            void *buff;
+            if (posix_memalign(&buff, ALIGNMENT, BUFFER_SIZE) != 0) {
+                ERROR("cannot allocate aligned I/O buffer of size " << BUFFER_SIZE);
+                return false;
+            }
+            buffers.push_back((char *)buff);
+        }
+    return parallel_for(workers_no, items, f);
+}
+
+bool region_io_t::write_direct(int fd, const io_layout_t &layout) {
+    io_layout_t segments = layout;
+    std::sort(segments.begin(), segments.end(),
+              [](const io_segment_t &a, const io_segment_t &b) { return a.offset < b.offset; });
+    size_t end = segments.empty() ? 0 : segments.back().offset + segments.back().size;
+    // each stripe gathers all segments it overlaps into a bounce buffer, gaps are zero-filled
+    bool success = run_parallel(threads, (end + BUFFER_SIZE - 1) / BUFFER_SIZE, [&](unsigned int id, size_t k) {
+        char *buff = buffers[id];
+        size_t start = k * BUFFER_SIZE, len = std::min(BUFFER_SIZE, end - start);
+        memset(buff, 0, align(len));
+        auto it = std::upper_bound(segments.begin(), segments.end(), start,
+                                   [](size_t off, const io_segment_t &s) { return off < s.offset + s.size; });
+        for (; it != segments.end() && it->offset < start + len; it++) {
+            size_t from = std::max(start, it->offset), to = std::min(start + len, it->offset + it->size);
+            memcpy(buff + from - start, it->ptr + from - it->offset, to - from);
+        }
+        if (!pwrite_all(fd, buff, align(len), start)) {
+            ERROR("cannot write " << align(len) << " bytes at offset " << start << ", error = " << std::strerror(errno));
+            return false;
+        }
+        return true;
+    });
+    // the last stripe was padded to the alignment, cut the file back to its logical size
+    if (success && ftruncate(fd, end) != 0) {
+        ERROR("cannot truncate checkpoint file to " << end << " bytes, error = " << std::strerror(errno));
+        return false;
+    }
+    return success;
+}
+
+bool region_io_t::read_direct(int fd, const io_layout_t &layout) {
+    // read each segment through aligned windows that cover it completely
+    std::vector<std::pair<size_t, size_t> > windows;
+    for (size_t i = 0; i < layout.size(); i++)
+        for (size_t w = layout[i].offset / ALIGNMENT * ALIGNMENT; w < layout[i].offset + layout[i].size; w += BUFFER_SIZE)
+            windows.emplace_back(i, w);
+    return run_parallel(read_threads, windows.size(), [&](unsigned int id, size_t k) {
+        char *buff = buffers[id];
+        const io_segment_t &s = layout[windows[k].first];
+        size_t start = windows[k].second, len = std::min(BUFFER_SIZE, align(s.offset + s.size) - start);
+        size_t from = std::max(start, s.offset), to = std::min(start + len, s.offset + s.size);
+        ssize_t br = pread_all(fd, buff, len, start);
+        if (br == -1 || start + br < to) {
+            ERROR("cannot read " << len << " bytes at offset " << start << ", error = " << std::strerror(errno));
+            return false;
+        }
+        memcpy(s.ptr + from - s.offset, buff + from - start, to - from);
+        return true;
+    });
+}
+
+bool region_io_t::run_ring(int fd, bool write, const io_layout_t &layout) {
+    std::vector<io_request_t> reqs;
+    for (auto &c : split_chunks(layout, CHUNK_SIZE))
+        reqs.emplace_back(fd, write, c.ptr, c.size, c.offset);
+    ring->register_files({fd});
+    bool success = ring->run(reqs);
+    ring->unregister();
+    return success;
+}
+
+bool region_io_t::write(const std::string &fname, const io_layout_t &layout) {
+    int fd = open_file(fname, O_CREAT | O_TRUNC | O_WRONLY);
+    if (fd == -1)
+        return false;
+    TIMER_START(io_timer);
+    bool success;
+    if (direct)
+        success = write_direct(fd, layout);
+    else if (ring != NULL)
+        success = run_ring(fd, true, layout);
+    else {
+        io_layout_t chunks = split_chunks(layout, CHUNK_SIZE);
+        success = run_parallel(threads, chunks.size(), [&](unsigned int, size_t i) {
+            if (!pwrite_all(fd, chunks[i].ptr, chunks[i].size, chunks[i].offset)) {
+                ERROR("cannot write " << chunks[i].size << " bytes at offset " << chunks[i].offset
+                      << ", error = " << std::strerror(errno));
+                return false;
+            }
+            return true;
+        });
+    }
+    success &= close(fd) == 0;
+    TIMER_STOP(io_timer, "wrote " << layout.size() << " segments to " << fname << ", direct = " << direct);
+    return success;
+}
+
+bool region_io_t::read(const std::string &fname, const io_layout_t &layout) {
+    int fd = open_file(fname, O_RDONLY);
+    if (fd == -1)
+        return false;
+    TIMER_START(io_timer);
+    bool success;
+    if (direct)
+        success = read_direct(fd, layout);
+    else if (ring != NULL)
+        success = run_ring(fd, false, layout);
+    else {
+        io_layout_t chunks = split_chunks(layout, CHUNK_SIZE);
+        success = run_parallel(read_threads, chunks.size(), [&](unsigned int, size_t i) {
+            if (pread_all(fd, chunks[i].ptr, chunks[i].size, chunks[i].offset) != (ssize_t)chunks[i].size) {
+                ERROR("cannot read " << chunks[i].size << " bytes at offset " << chunks[i].offset
+                      << ", error = " << std::strerror(errno));
+                return false;
+            }
+            return true;
+        });
+    }
+    close(fd);
+    TIMER_STOP(io_timer, "read " << layout.size() << " segments from " << fname << ", direct = " << direct);
+    return success;
+}
+
+bool region_io_t::patch(const std::string &fname, const io_layout_t &layout) {
+    if (layout.empty())
+        return true;
+    int fd = open(fname.c_str(), O_WRONLY);
+    if (fd == -1) {
+        ERROR("cannot open " << fname << ", error = " << std::strerror(errno));
+        return false;
+    }
+    bool success = true;
+    for (auto &s : layout)
+        if (!pwrite_all(fd, s.ptr, s.size, s.offset)) {
+            ERROR("cannot write " << s.size << " bytes at offset " << s.offset << ", error = " << std::strerror(errno));
+            success = false;
+            break;
+        }
+    success &= close(fd) == 0;
+    return success;
+}
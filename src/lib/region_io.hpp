@@ -0,0 +1,84 @@
+#ifndef __REGION_IO_HPP
+#define __REGION_IO_HPP
+
+#include "common/config.hpp"
+#include "common/uring.hpp"
+
+#include <string>
+#include <vector>
+#include <atomic>
+#include <future>
+#include <algorithm>
+
+// contiguous piece of the checkpoint file backed by a memory buffer
+struct io_segment_t {
+    size_t offset, size;
+    char *ptr;
+    io_segment_t(size_t o, size_t s, char *p) : offset(o), size(s), ptr(p) { }
+};
+typedef std::vector<io_segment_t> io_layout_t;
+
+// runs f(worker_id, item) for all items on up to the given number of threads, stops at the first failure
+template <typename F> bool parallel_for(unsigned int threads, size_t items, F f) {
+    unsigned int workers_no = std::max((size_t)1, std::min((size_t)threads, items));
+    std::atomic<size_t> next(0);
+    auto worker = [&](unsigned int id) {
+        for (size_t i = next++; i < items; i = next++)
+            if (!f(id, i)) {
+                next = items;
+                return false;
+            }
+        return true;
+    };
+    std::vector<std::future<bool> > workers;
+    for (unsigned int i = 1; i < workers_no; i++)
+        workers.push_back(std::async(std::launch::async, worker, i));
+    bool success = worker(0);
+    for (auto &w : workers)
+        success &= w.get();
+    return success;
+}
+
+class region_io_t {
+    static constexpr size_t CHUNK_SIZE = 1 << 26, ALIGNMENT = 1 << 12, BUFFER_SIZE = 1 << 24;
+    // restart is usually not overlapped with computation, so it may use more threads than checkpointing
+    unsigned int threads = 1, read_threads = 1;
+    bool direct = false;
+    // aligned bounce buffers for O_DIRECT, one per thread, reused across checkpoints
+    std::vector<char *> buffers;
+    // buffered I/O is submitted in batches through io_uring instead of the worker threads if set
+    uring_t *ring = NULL;
+
+    int open_file(const std::string &fname, int flags);
+    template <typename F> bool run_parallel(unsigned int workers, size_t items, F f);
+    bool write_direct(int fd, const io_layout_t &layout);
+    bool read_direct(int fd, const io_layout_t &layout);
+    bool run_ring(int fd, bool write, const io_layout_t &layout);
+
+public:
+    region_io_t(const config_t &cfg);
+    region_io_t(const region_io_t &other) = delete;
+    ~region_io_t();
+
+    bool is_default() const {
+        return threads == 1 && !direct && ring == NULL;
+    }
+    bool is_direct() const {
+        return direct;
+    }
+    unsigned int get_threads() const {
+        return threads;
+    }
+    unsigned int get_read_threads() const {
+        return read_threads;
+    }
+    size_t align(size_t offset) const {
+        return direct ? (offset + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT : offset;
+    }
+    bool write(const std::string &fname, const io_layout_t &layout);
+    bool read(const std::string &fname, const io_layout_t &layout);
+    // overwrite parts of an existing file in place
+    bool patch(const std::string &fname, const io_layout_t &layout);
+};
+
+#endif // __REGION_IO_HPP
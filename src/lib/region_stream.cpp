@@ -0,0 +1,102 @@
+#include "region_stream.hpp"
+
+#include <cstdlib>
+#include <climits>
+#include <cstring>
+#include <algorithm>
+
+//#define __DEBUG
+#include "common/debug.hpp"
+
+arena_streambuf_t::~arena_streambuf_t() {
+    free(base);
+}
+
+void arena_streambuf_t::advance(size_t n) {
+    // pbump takes an int
+    while (n > 0) {
+        int step = std::min(n, (size_t)INT_MAX);
+        pbump(step);
+        n -= step;
+    }
+}
+
+bool arena_streambuf_t::reserve(size_t needed) {
+    if (needed <= capacity)
+        return true;
+    size_t used = size(), new_capacity = std::max({needed, 2 * capacity, (size_t)MIN_CAPACITY});
+    char *ptr = (char *)realloc(base, new_capacity);
+    if (ptr == NULL) {
+        ERROR("cannot grow serialization arena to " << new_capacity << " bytes");
+        return false;
+    }
+    base = ptr;
+    capacity = new_capacity;
+    setp(base, base + capacity);
+    advance(used);
+    return true;
+}
+
+void arena_streambuf_t::reset() {
+    setp(base, base + capacity);
+}
+
+arena_streambuf_t::int_type arena_streambuf_t::overflow(int_type c) {
+    if (traits_type::eq_int_type(c, traits_type::eof()))
+        return traits_type::not_eof(c);
+    if (!reserve(size() + 1))
+        return traits_type::eof();
+    *pptr() = traits_type::to_char_type(c);
+    pbump(1);
+    return c;
+}
+
+std::streamsize arena_streambuf_t::xsputn(const char *s, std::streamsize n) {
+    if (n <= 0)
+        return 0;
+    if (!reserve(size() + n))
+        return 0;
+    memcpy(pptr(), s, n);
+    advance(n);
+    return n;
+}
+
+arena_streambuf_t::pos_type arena_streambuf_t::seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which) {
+    // only reporting the current position is supported, which is what tellp needs
+    if (off == 0 && dir == std::ios_base::cur && (which & std::ios_base::out))
+        return pos_type(size());
+    return pos_type(off_type(-1));
+}
+
+arena_streambuf_t::pos_type arena_streambuf_t::seekpos(pos_type pos, std::ios_base::openmode which) {
+    return seekoff(off_type(pos) - off_type(size()), std::ios_base::cur, which);
+}
+
+bool arena_streambuf_t::serialize(const std::function<void (std::ostream &)> &s, size_t &offset, size_t &size) {
+    std::ostream out(this);
+    offset = this->size();
+    s(out);
+    size = this->size() - offset;
+    return !out.fail();
+}
+
+std::streamsize span_streambuf_t::xsgetn(char *s, std::streamsize n) {
+    n = std::min(n, (std::streamsize)(egptr() - gptr()));
+    memcpy(s, gptr(), n);
+    setg(eback(), gptr() + n, egptr());
+    return n;
+}
+
+span_streambuf_t::pos_type span_streambuf_t::seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which) {
+    if (!(which & std::ios_base::in))
+        return pos_type(off_type(-1));
+    off_type pos = off + (dir == std::ios_base::beg ? 0 : dir == std::ios_base::cur ? gptr() - eback() : egptr() - eback());
+    if (pos < 0 || pos > egptr() - eback())
+        return pos_type(off_type(-1));
+    setg(eback(), eback() + pos, egptr());
+    return pos_type(pos);
+}
+
+span_streambuf_t::pos_type span_streambuf_t::seekpos(pos_type pos, std::ios_base::openmode which) {
+    return seekoff(off_type(pos), std::ios_base::beg, which);
+}
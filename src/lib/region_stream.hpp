@@ -0,0 +1,54 @@
+#ifndef __REGION_STREAM_HPP
+#define __REGION_STREAM_HPP
+
+#include <streambuf>
+#include <ostream>
+#include <functional>
+#include <cstddef>
+
+// growable output buffer that collects serialized regions back to back, its memory is reused across checkpoints
+class arena_streambuf_t : public std::streambuf {
+    static const size_t MIN_CAPACITY = 1 << 20;
+    char *base = NULL;
+    size_t capacity = 0;
+
+    bool reserve(size_t needed);
+    void advance(size_t n);
+
+protected:
+    virtual int_type overflow(int_type c);
+    virtual std::streamsize xsputn(const char *s, std::streamsize n);
+    virtual pos_type seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which);
+    virtual pos_type seekpos(pos_type pos, std::ios_base::openmode which);
+
+public:
+    arena_streambuf_t() { }
+    arena_streambuf_t(const arena_streambuf_t &other) = delete;
+    ~arena_streambuf_t();
+
+    // discard the contents, pointers obtained from data() are invalidated by any further write
+    void reset();
+    char *data() const {
+        return base;
+    }
+    size_t size() const {
+        return pptr() - pbase();
+    }
+    // append the output of the serializer, returns where it starts in the arena and its size
+    bool serialize(const std::function<void (std::ostream &)> &s, size_t &offset, size_t &size);
+};
+
+// read-only stream buffer over memory that is already there, used to deserialize without copying
+class span_streambuf_t : public std::streambuf {
+protected:
+    virtual std::streamsize xsgetn(char *s, std::streamsize n);
+    virtual pos_type seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which);
+    virtual pos_type seekpos(pos_type pos, std::ios_base::openmode which);
+
+public:
+    span_streambuf_t(char *ptr, size_t size) {
+        setg(ptr, ptr, ptr + size);
+    }
+};
+
+#endif // __REGION_STREAM_HPP
@@ -88,6 +88,14 @@ extern "C" int VELOC_Checkpoint_finished() {
     return BOOL_CALL(veloc_client->checkpoint_finished());
 }
 
+extern "C" int VELOC_Checkpoint_wait_version(const char *name, int version) {
+    return BOOL_CALL(veloc_client->checkpoint_wait(name, version));
+}
+
+extern "C" int VELOC_Checkpoint_finished_version(const char *name, int version) {
+    return BOOL_CALL(veloc_client->checkpoint_finished(name, version));
+}
+
 extern "C" int VELOC_Restart_test(const char *name, int version) {
     return INT_CALL(veloc_client->restart_test(name, version));
 }
@@ -50,7 +50,7 @@ int chksum_module_t::process_command(const command_t &c) {
 
     switch (c.command) {
     case command_t::CHECKPOINT:
-        if (!chksum_file(local, chksum))
+        if (!chksum_file(c.source(cfg.get("scratch")), chksum))
             return VELOC_FAILURE;
         return write_file(meta, chksum, HASH_SIZE) ? VELOC_SUCCESS : VELOC_FAILURE;
 
@@ -0,0 +1,21 @@
+#include "memfd_module.hpp"
+#include "common/file_util.hpp"
+
+#include <unistd.h>
+
+//#define __DEBUG
+#include "common/debug.hpp"
+
+memfd_module_t::memfd_module_t(const config_t &c) : cfg(c) {
+}
+
+int memfd_module_t::process_command(const command_t &c) {
+    if (c.command != command_t::CHECKPOINT || c.memfd < 0)
+        return VELOC_IGNORED;
+
+    std::string local = c.filename(cfg.get("scratch"));
+    // a stale copy of the same version would not be truncated
+    unlink(local.c_str());
+    DBG("copy memfd " << c.source(cfg.get("scratch")) << " to " << local);
+    return posix_transfer_file(c.source(cfg.get("scratch")), local) ? VELOC_SUCCESS : VELOC_FAILURE;
+}
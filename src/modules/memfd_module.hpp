@@ -0,0 +1,17 @@
+#ifndef __MEMFD_MODULE_HPP
+#define __MEMFD_MODULE_HPP
+
+#include "common/config.hpp"
+#include "common/command.hpp"
+#include "common/status.hpp"
+
+// copies checkpoints handed over as memfds to scratch, where restart expects to find them
+class memfd_module_t {
+    const config_t &cfg;
+public:
+    memfd_module_t(const config_t &c);
+    ~memfd_module_t() { }
+    int process_command(const command_t &c);
+};
+
+#endif //__MEMFD_MODULE_HPP
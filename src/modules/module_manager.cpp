@@ -1,5 +1,7 @@
 #include "module_manager.hpp"
 
+#include <future>
+
 #define __DEBUG
 #include "common/debug.hpp"
 
@@ -8,7 +10,10 @@ module_manager_t::module_manager_t() { }
 void module_manager_t::add_default(const config_t &cfg, MPI_Comm comm) {
     watchdog = new client_watchdog_t(cfg);
     add_module([this](const command_t &c) { return watchdog->process_command(c); });
+    // memfd checkpoints are copied to scratch last, unless EC needs them there first
+    memfd = new memfd_module_t(cfg);
     if (comm != MPI_COMM_NULL) {
+        add_module([this](const command_t &c) { return memfd->process_command(c); });
         redset = new ec_module_t(cfg, comm);
         ec_agg = new client_aggregator_t(cfg,
             [this](const std::vector<command_t> &cmds) {
@@ -19,12 +24,16 @@ void module_manager_t::add_default(const config_t &cfg, MPI_Comm comm) {
             });
         add_module([this](const command_t &c) { return ec_agg->process_command(c); });
     }
-    transfer = new transfer_module_t(cfg);
+    catalog = new version_catalog_t(cfg);
+    budget = new scratch_budget_t(cfg);
+    transfer = new transfer_module_t(cfg, *catalog, *budget);
     add_module([this](const command_t &c) { return transfer->process_command(c); });
     chksum = new chksum_module_t(cfg);
     add_module([this](const command_t &c) { return chksum->process_command(c); });
-    versioning = new versioning_module_t(cfg);
+    versioning = new versioning_module_t(cfg, *catalog);
     add_module([this](const command_t &c) { return versioning->process_command(c); });
+    if (comm == MPI_COMM_NULL)
+        add_module([this](const command_t &c) { return memfd->process_command(c); });
 }
 
 module_manager_t::~module_manager_t() {
@@ -34,9 +43,40 @@ module_manager_t::~module_manager_t() {
     delete transfer;
     delete chksum;
     delete versioning;
+    delete memfd;
+    delete catalog;
+    delete budget;
+}
+
+void module_manager_t::notify_queued(const command_t &c) {
+    if (budget != NULL && c.command == command_t::CHECKPOINT)
+        budget->track(c);
+}
+
+void module_manager_t::notify_admit(const command_t &c, const scratch_budget_t::completion_t &done) {
+    if (budget != NULL)
+        budget->admit(c, done);
+    else
+        done(VELOC_IGNORED);
 }
 
 int module_manager_t::notify_command(const command_t &c) {
+    if (c.command == command_t::ADMIT) {
+        std::promise<int> admitted;
+        notify_admit(c, [&admitted](int ret) { admitted.set_value(ret); });
+        return admitted.get_future().get();
+    }
+    int ret = process_command(c);
+    // a checkpoint whose flush was skipped must not be reported as persisted
+    if (budget != NULL && c.command == command_t::CHECKPOINT && budget->release(c) && ret == VELOC_SUCCESS)
+        ret = VELOC_IGNORED;
+    return ret;
+}
+
+int module_manager_t::process_command(const command_t &c) {
+    // all modules must see the scratch file of a restart either complete or missing
+    if (transfer != NULL && c.command == command_t::RESTART)
+        transfer->wait_prefetch(c);
     int ret = VELOC_IGNORED;
     for (auto &f : modules) {
         int mod_ret = f(c);
@@ -45,5 +85,12 @@ int module_manager_t::notify_command(const command_t &c) {
             return VELOC_FAILURE;
         ret = std::max(ret, mod_ret);
     }
+    // the version found by a test is most likely restarted next
+    if (transfer != NULL && c.command == command_t::TEST && ret >= 0) {
+        command_t next = c;
+        next.command = command_t::RESTART;
+        next.version = ret;
+        transfer->prefetch(next);
+    }
     return ret;
 }
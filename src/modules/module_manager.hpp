@@ -10,6 +10,9 @@
 #include "modules/transfer_module.hpp"
 #include "modules/chksum_module.hpp"
 #include "modules/versioning_module.hpp"
+#include "modules/memfd_module.hpp"
+#include "modules/version_catalog.hpp"
+#include "modules/scratch_budget.hpp"
 
 #include <functional>
 #include <vector>
@@ -25,6 +28,11 @@ class module_manager_t {
     ec_module_t *redset = NULL;
     chksum_module_t *chksum = NULL;
     versioning_module_t *versioning = NULL;
+    memfd_module_t *memfd = NULL;
+    version_catalog_t *catalog = NULL;
+    scratch_budget_t *budget = NULL;
+
+    int process_command(const command_t &c);
 
 public:
     module_manager_t();
@@ -33,6 +41,10 @@ public:
     void add_module(const method_t &m) {
         modules.push_back(m);
     }
+    // called by the dispatcher in queue order, before the command is processed
+    void notify_queued(const command_t &c);
+    // ADMIT commands are answered through done once admitted, so they do not hold up a thread while they wait
+    void notify_admit(const command_t &c, const scratch_budget_t::completion_t &done);
     int notify_command(const command_t &c);
 };
 
@@ -0,0 +1,142 @@
+#include "scratch_budget.hpp"
+#include "common/file_util.hpp"
+#include "common/ckpt_util.hpp"
+#include "storage/storage_module.hpp"
+
+#include <vector>
+#include <cstring>
+
+//#define __DEBUG
+#include "common/debug.hpp"
+
+scratch_budget_t::scratch_budget_t(const config_t &c) : cfg(c) {
+    unsigned int mib;
+    if (!cfg.get_optional("scratch_budget", mib) || mib == 0)
+        return;
+    budget = (size_t)mib << 20;
+    std::string policy;
+    if (cfg.get_optional("scratch_policy", policy) && policy != "throttle") {
+        if (policy == "coalesce")
+            coalesce = true;
+        else
+            ERROR("scratch policy " << policy << " unknown, falling back to throttle");
+    }
+    INFO("limiting checkpoints not flushed yet to " << mib << " MiB on scratch, policy: " << (coalesce ? "coalesce" : "throttle"));
+}
+
+// version an incremental checkpoint builds upon, -1 for a full checkpoint
+static int delta_base(const std::string &fname) {
+    file_reader_t reader(fname);
+    char magic[sizeof(ckpt_header_t::MAGIC)] = {};
+    // incremental checkpoints always use the v2 header
+    if (!reader.is_open() || reader.size() < sizeof(magic) || !reader.read(magic, sizeof(magic), 0)
+        || memcmp(magic, ckpt_header_t::MAGIC, sizeof(magic)) != 0)
+        return -1;
+    ckpt_header_t header;
+    delta_info_t delta;
+    if (!read_header(reader, header) || header.regions.count(delta_info_t::REGION_ID) == 0
+        || !read_delta_info(reader, header, delta))
+        return -1;
+    return delta.base_version;
+}
+
+void scratch_budget_t::drop_reservation(int id) {
+    auto it = reserved.find(id);
+    if (it == reserved.end())
+        return;
+    in_flight -= it->second;
+    reserved.erase(it);
+}
+
+bool scratch_budget_t::try_admit(const command_t &c) {
+    if (!coalesce && queued.count(c.unique_id) > 0 && in_flight + c.offset > budget)
+        return false;
+    reserved[c.unique_id] = c.offset;
+    in_flight += c.offset;
+    return true;
+}
+
+void scratch_budget_t::admit(const command_t &c, const completion_t &done) {
+    if (!enabled()) {
+        done(VELOC_IGNORED);
+        return;
+    }
+    std::unique_lock<std::mutex> lock(budget_lock);
+    // a reservation that was not followed by a checkpoint belongs to an abandoned one
+    drop_reservation(c.unique_id);
+    DBG("client " << c.unique_id << " asks for " << c.offset << " bytes, in flight: " << in_flight);
+    if (!try_admit(c)) {
+        parked.emplace_back(c, done);
+        return;
+    }
+    lock.unlock();
+    done(VELOC_SUCCESS);
+}
+
+void scratch_budget_t::track(const command_t &c) {
+    if (!enabled())
+        return;
+    std::string source = c.source(cfg.get("scratch"));
+    ssize_t size = file_size(source);
+    int base = coalesce ? delta_base(source) : -1;
+    std::unique_lock<std::mutex> lock(budget_lock);
+    drop_reservation(c.unique_id);
+    versions_t &versions = queued[c.unique_id];
+    version_t &v = versions[std::make_pair(std::string(c.name), c.version)];
+    in_flight -= v.bytes;
+    v.bytes = size > 0 ? size : 0;
+    in_flight += v.bytes;
+    if (base < 0)
+        return;
+    v.delta = true;
+    auto e = versions.find(std::make_pair(std::string(c.name), base));
+    if (e != versions.end())
+        e->second.base = true;
+}
+
+bool scratch_budget_t::release(const command_t &c) {
+    if (!enabled())
+        return false;
+    std::unique_lock<std::mutex> lock(budget_lock);
+    auto it = queued.find(c.unique_id);
+    if (it == queued.end())
+        return false;
+    auto e = it->second.find(std::make_pair(std::string(c.name), c.version));
+    if (e == it->second.end())
+        return false;
+    bool skipped = e->second.skipped;
+    in_flight -= e->second.bytes;
+    it->second.erase(e);
+    if (it->second.empty())
+        queued.erase(it);
+    std::vector<completion_t> admitted;
+    for (auto p = parked.begin(); p != parked.end();)
+        if (try_admit(p->first)) {
+            admitted.push_back(std::move(p->second));
+            p = parked.erase(p);
+        } else
+            ++p;
+    lock.unlock();
+    for (auto &done : admitted)
+        done(VELOC_SUCCESS);
+    return skipped;
+}
+
+bool scratch_budget_t::superseded(const command_t &c) {
+    if (!enabled() || !coalesce)
+        return false;
+    std::unique_lock<std::mutex> lock(budget_lock);
+    if (in_flight <= budget)
+        return false;
+    auto it = queued.find(c.unique_id);
+    if (it == queued.end())
+        return false;
+    auto e = it->second.find(std::make_pair(std::string(c.name), c.version));
+    if (e == it->second.end() || e->second.delta || e->second.base)
+        return false;
+    auto next = std::next(e);
+    if (next == it->second.end() || next->first.first != c.name)
+        return false;
+    e->second.skipped = true;
+    return true;
+}
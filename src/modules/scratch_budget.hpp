@@ -0,0 +1,53 @@
+#ifndef __SCRATCH_BUDGET_HPP
+#define __SCRATCH_BUDGET_HPP
+
+#include "common/config.hpp"
+#include "common/command.hpp"
+#include "common/status.hpp"
+
+#include <functional>
+#include <mutex>
+#include <deque>
+#include <map>
+
+// bytes of the checkpoints written to scratch whose flush is not finished yet, shared by all clients
+class scratch_budget_t {
+public:
+    typedef std::function<void (int)> completion_t;
+private:
+    struct version_t {
+        size_t bytes = 0;
+        // only a full checkpoint that no queued incremental checkpoint builds upon can be skipped
+        bool delta = false, base = false, skipped = false;
+    };
+    typedef std::map<std::pair<std::string, int>, version_t> versions_t;
+    const config_t &cfg;
+    size_t budget = 0, in_flight = 0;
+    bool coalesce = false;
+    std::mutex budget_lock;
+    // admitted checkpoints not queued yet and queued checkpoints by (name, version), per client
+    std::map<int, size_t> reserved;
+    std::map<int, versions_t> queued;
+    // ADMIT commands that did not fit yet, answered in arrival order as flushes finish
+    std::deque<std::pair<command_t, completion_t> > parked;
+
+    void drop_reservation(int id);
+    bool try_admit(const command_t &c);
+public:
+    scratch_budget_t(const config_t &c);
+    bool enabled() const {
+        return budget > 0;
+    }
+    // ADMIT command: done is called once c.offset more bytes fit in the budget (right away if the client has
+    // nothing in flight), without holding up the caller in the meantime
+    void admit(const command_t &c, const completion_t &done);
+    // account for a checkpoint when it is queued for the flush and when its processing is finished, release
+    // returns true if its flush was skipped
+    void track(const command_t &c);
+    bool release(const command_t &c);
+    // over budget and a newer version of the same checkpoint is queued, so the flush of c can be skipped
+    // unless c is incremental or the base of a queued incremental checkpoint
+    bool superseded(const command_t &c);
+};
+
+#endif //__SCRATCH_BUDGET_HPP
@@ -4,11 +4,13 @@
 #include "common/file_util.hpp"
 
 #include <unistd.h>
+#include <cstring>
+#include <vector>
 
 //#define __DEBUG
 #include "common/debug.hpp"
 
-transfer_module_t::transfer_module_t(const config_t &c) : cfg(c) {
+transfer_module_t::transfer_module_t(const config_t &c, version_catalog_t &vc, scratch_budget_t &sb) : cfg(c), catalog(vc), budget(sb) {
     if (!cfg.storage()) {
         interval = -1;
         INFO("Persistent storage not specified, deactivating");
@@ -18,6 +20,68 @@ transfer_module_t::transfer_module_t(const config_t &c) : cfg(c) {
         INFO("Persistence interval not specified, every checkpoint will be persisted");
         interval = 0;
     }
+    prefetch_enabled = cfg.get_bool("prefetch", false);
+}
+
+transfer_module_t::~transfer_module_t() {
+    for (auto &p : prefetches)
+        p.second.task.wait();
+}
+
+void transfer_module_t::drop_prefetches(const command_t *c) {
+    std::vector<std::future<bool> > pending;
+    std::unique_lock<std::mutex> lock(prefetch_lock);
+    for (auto it = prefetches.begin(); it != prefetches.end();) {
+        prefetch_t &p = it->second;
+        if (p.task.wait_for(std::chrono::seconds(0)) == std::future_status::ready)
+            it = prefetches.erase(it);
+        else if (c != NULL && p.cmd.unique_id == c->unique_id && strcmp(p.cmd.name, c->name) == 0) {
+            pending.push_back(std::move(p.task));
+            it = prefetches.erase(it);
+        } else
+            ++it;
+    }
+    lock.unlock();
+    for (auto &f : pending)
+        f.wait();
+}
+
+void transfer_module_t::prefetch(const command_t &c) {
+    if (interval < 0 || !prefetch_enabled)
+        return;
+    drop_prefetches(NULL);
+    std::string scratch = cfg.get("scratch"), local = c.filename(scratch);
+    std::unique_lock<std::mutex> lock(prefetch_lock);
+    if (prefetches.count(local) > 0 || access(local.c_str(), R_OK) == 0)
+        return;
+    DBG("prefetching remote file " << c.stem() << " to " << local);
+    prefetches[local] = {c, std::async(std::launch::async, [this, c, scratch, local]() {
+        if (!cfg.storage()->exists(c))
+            return false;
+        TIMER_START(prefetch_timer);
+        // a partial copy must not be mistaken for a valid local checkpoint, so it only gets its name once complete
+        std::string tmp = scratch + "/." + c.stem() + ".tmp";
+        bool success = cfg.storage()->restore(c, tmp);
+        if (success && rename(tmp.c_str(), local.c_str()) != 0) {
+            ERROR("cannot rename " << tmp << " to " << local << "; error = " << std::strerror(errno));
+            success = false;
+        }
+        if (!success)
+            unlink(tmp.c_str());
+        TIMER_STOP(prefetch_timer, "prefetched " << c.stem() << " to " << local << ", success = " << success);
+        return success;
+    })};
+}
+
+void transfer_module_t::wait_prefetch(const command_t &c) {
+    std::unique_lock<std::mutex> lock(prefetch_lock);
+    auto it = prefetches.find(c.filename(cfg.get("scratch")));
+    if (it == prefetches.end())
+        return;
+    std::future<bool> f = std::move(it->second.task);
+    prefetches.erase(it);
+    lock.unlock();
+    f.wait();
 }
 
 int transfer_module_t::process_command(const command_t &c) {
@@ -42,8 +106,19 @@ int transfer_module_t::process_command(const command_t &c) {
             else
                 last_timestamp[c.unique_id] = t + std::chrono::seconds(interval);
         }
+        // under overload, only the latest of the queued versions is flushed
+        if (budget.superseded(c)) {
+            INFO("scratch budget exceeded, skipping flush of " << c.stem() << " superseded by a newer version");
+            return VELOC_IGNORED;
+        }
+        // a version staged for a restart that never came is not needed once the application checkpoints again
+        if (prefetch_enabled)
+            drop_prefetches(&c);
         DBG("transfer local file " << local << " to " << remote);
-        return cfg.storage()->flush(c) ? VELOC_SUCCESS : VELOC_FAILURE;
+        if (!cfg.storage()->flush(c))
+            return VELOC_FAILURE;
+        catalog.add(c);
+        return VELOC_SUCCESS;
 
     case command_t::RESTART:
         DBG("checking local file: " << local);
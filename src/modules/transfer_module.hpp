@@ -4,21 +4,42 @@
 #include "common/config.hpp"
 #include "common/command.hpp"
 #include "common/status.hpp"
+#include "modules/version_catalog.hpp"
+#include "modules/scratch_budget.hpp"
 
 #include <chrono>
 #include <map>
 #include <mutex>
+#include <future>
 
 class transfer_module_t {
     const config_t &cfg;
+    version_catalog_t &catalog;
+    scratch_budget_t &budget;
     int interval;
     std::mutex ts_lock;
     std::map<int, std::chrono::system_clock::time_point> last_timestamp;
+    // checkpoints staged from persistent to scratch in the background, by scratch file name
+    struct prefetch_t {
+        command_t cmd;
+        std::future<bool> task;
+    };
+    bool prefetch_enabled = false;
+    std::mutex prefetch_lock;
+    std::map<std::string, prefetch_t> prefetches;
+
+    // forget the finished prefetches and wait for those of the same checkpoint as c, if any
+    void drop_prefetches(const command_t *c);
 
     int transfer_file(const std::string &source, const std::string &dest);
 public:
-    transfer_module_t(const config_t &c);
+    transfer_module_t(const config_t &c, version_catalog_t &vc, scratch_budget_t &sb);
+    ~transfer_module_t();
     int process_command(const command_t &c);
+    // start copying the given checkpoint to scratch in the background, unless it is already there
+    void prefetch(const command_t &c);
+    // wait until the checkpoint needed by c is no longer being staged
+    void wait_prefetch(const command_t &c);
 };
 
 #endif //__TRANSFER_MODULE_HPP
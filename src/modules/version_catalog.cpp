@@ -0,0 +1,130 @@
+#include "version_catalog.hpp"
+#include "common/file_util.hpp"
+
+#include <vector>
+#include <map>
+
+#include <unistd.h>
+#include <fcntl.h>
+
+//#define __DEBUG
+#include "common/debug.hpp"
+
+// number of obsolete entries tolerated before the catalog is compacted
+static const size_t MAX_STALE = 64;
+
+version_catalog_t::version_catalog_t(const config_t &c) : cfg(c) {
+    if (cfg.storage() && cfg.get_optional("meta", meta))
+        INFO("keeping track of persisted versions in " << meta << ", change using 'meta'");
+}
+
+std::string version_catalog_t::catalog_filename(const command_t &c) const {
+    return meta + "/" + std::string(c.name) + "-" + std::to_string(c.unique_id) + ".catalog";
+}
+
+bool version_catalog_t::load(const command_t &c, std::set<int> &versions) {
+    std::string fname = catalog_filename(c);
+    ssize_t size = file_size(fname);
+    if (size < 0)
+        return false;
+    std::vector<entry_t> entries(size / sizeof(entry_t));
+    if (!read_file(fname, (unsigned char *)entries.data(), entries.size() * sizeof(entry_t)))
+        return false;
+    for (auto &e : entries)
+        if (e.removed)
+            versions.erase(e.version);
+        else
+            versions.insert(e.version);
+    if (entries.size() > 2 * versions.size() + MAX_STALE)
+        create(c, versions);
+    return true;
+}
+
+bool version_catalog_t::create(const command_t &c, std::set<int> &versions, bool replace) {
+    // the catalog is replaced atomically, so that readers never see it partially written
+    std::string fname = catalog_filename(c), tmp = fname + "." + unique_suffix();
+    std::vector<entry_t> entries;
+    for (int v : versions)
+        entries.push_back({v, 0});
+    if (!write_file(tmp, (unsigned char *)entries.data(), entries.size() * sizeof(entry_t)))
+        return false;
+    if (!replace) {
+        // catalogs of other ranks are only created if missing, another backend may be appending to them already
+        bool success = link(tmp.c_str(), fname.c_str()) == 0 || errno == EEXIST;
+        if (!success)
+            ERROR("cannot create catalog " << fname << ", error = " << std::strerror(errno));
+        unlink(tmp.c_str());
+        return success;
+    }
+    if (rename(tmp.c_str(), fname.c_str()) != 0) {
+        ERROR("cannot create catalog " << fname << ", error = " << std::strerror(errno));
+        unlink(tmp.c_str());
+        return false;
+    }
+    DBG("created catalog " << fname << " with " << versions.size() << " versions");
+    return true;
+}
+
+bool version_catalog_t::append(const command_t &c, int removed) {
+    std::string fname = catalog_filename(c);
+    entry_t e = {c.version, removed};
+    int fd = open(fname.c_str(), O_WRONLY | O_APPEND);
+    if (fd == -1) {
+        ERROR("cannot open catalog " << fname << ", error = " << std::strerror(errno));
+        return false;
+    }
+    bool success = write(fd, &e, sizeof(e)) == sizeof(e);
+    if (!success)
+        ERROR("cannot append version " << c.version << " to catalog " << fname << ", error = " << std::strerror(errno));
+    close(fd);
+    return success;
+}
+
+bool version_catalog_t::build(const command_t &c, std::set<int> &versions) {
+    // a single listing of the storage serves all ranks, instead of one listing per rank on a cold start
+    std::map<int, std::set<int> > all;
+    TIMER_START(list_timer);
+    cfg.storage()->get_all_versions(c, all);
+    TIMER_STOP(list_timer, "listed versions of " << all.size() << " ranks for checkpoint " << c.name);
+    for (auto &e : all) {
+        if (e.first == c.unique_id)
+            continue;
+        command_t other(e.first, c.command, 0, c.name);
+        if (access(catalog_filename(other).c_str(), F_OK) != 0)
+            create(other, e.second, false);
+    }
+    versions = all[c.unique_id];
+    return create(c, versions);
+}
+
+void version_catalog_t::get_versions(const command_t &c, std::set<int> &result) {
+    if (meta.empty()) {
+        cfg.storage()->get_versions(c, result);
+        return;
+    }
+    std::unique_lock<std::mutex> lock(catalog_lock);
+    std::set<int> versions;
+    if (!load(c, versions))
+        build(c, versions);
+    result.insert(versions.begin(), versions.end());
+}
+
+bool version_catalog_t::add(const command_t &c) {
+    if (meta.empty())
+        return true;
+    std::unique_lock<std::mutex> lock(catalog_lock);
+    if (access(catalog_filename(c).c_str(), F_OK) == 0)
+        return append(c, 0);
+    // versions flushed before the catalog existed need to be listed once, c is among them
+    std::set<int> versions;
+    return build(c, versions);
+}
+
+bool version_catalog_t::remove(const command_t &c) {
+    if (meta.empty())
+        return true;
+    std::unique_lock<std::mutex> lock(catalog_lock);
+    if (access(catalog_filename(c).c_str(), F_OK) != 0)
+        return true;
+    return append(c, 1);
+}
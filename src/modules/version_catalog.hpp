@@ -0,0 +1,35 @@
+#ifndef __VERSION_CATALOG_HPP
+#define __VERSION_CATALOG_HPP
+
+#include "common/config.hpp"
+#include "common/command.hpp"
+
+#include <mutex>
+#include <set>
+
+// append-only index of the versions available on persistent storage, one file per checkpoint name and rank in meta
+class version_catalog_t {
+    struct entry_t {
+        int version, removed;
+    };
+    const config_t &cfg;
+    std::mutex catalog_lock;
+    std::string meta = "";
+
+    std::string catalog_filename(const command_t &c) const;
+    bool load(const command_t &c, std::set<int> &versions);
+    bool create(const command_t &c, std::set<int> &versions, bool replace = true);
+    bool build(const command_t &c, std::set<int> &versions);
+    bool append(const command_t &c, int removed);
+
+public:
+    version_catalog_t(const config_t &c);
+    // lists the storage only if the catalog of c does not exist yet (or if there is no meta directory), in which case
+    // the catalogs of all ranks found are created at once
+    void get_versions(const command_t &c, std::set<int> &result);
+    // record that c was flushed to or removed from the storage
+    bool add(const command_t &c);
+    bool remove(const command_t &c);
+};
+
+#endif //__VERSION_CATALOG_HPP
@@ -14,7 +14,7 @@ static void scratch_version_set(const std::string &p, const char *cname, int req
               });
 }
 
-versioning_module_t::versioning_module_t(const config_t &c) : cfg(c) {
+versioning_module_t::versioning_module_t(const config_t &c, version_catalog_t &vc) : cfg(c), catalog(vc) {
     if (cfg.storage() && !cfg.get_optional("max_versions", max_versions)) {
         max_versions = 0;
         INFO("persisting last " << max_versions << " checkpoints to " << cfg.get("persistent") << " (0 means all), change using 'max_versions'");
@@ -37,19 +37,21 @@ int versioning_module_t::process_command(const command_t &c) {
     case command_t::TEST:
         ph.clear();
         if (cfg.storage())
-            cfg.storage()->get_versions(c, ph);
+            catalog.get_versions(c, ph);
         sh.clear();
         scratch_version_set(cfg.get("scratch"), c.name, c.unique_id, sh);
         std::set_union(ph.begin(), ph.end(), sh.begin(), sh.end(),
                        std::inserter(versions, versions.begin()));
-        if (versions.size() == 0)
-            return VELOC_IGNORED;
-        if (c.version == 0)
-            return *versions.begin();
-        else {
-            auto it = versions.lower_bound(c.version);
-            return it != versions.end() ? *it : VELOC_IGNORED;
+        // the catalog misses versions removed by other means, make sure the persisted one found is still there
+        for (auto it = c.version == 0 ? versions.begin() : versions.lower_bound(c.version); it != versions.end(); it++) {
+            command_t found = c;
+            found.version = *it;
+            if (sh.count(*it) > 0 || cfg.storage()->exists(found))
+                return *it;
+            ph.erase(*it);
+            catalog.remove(found);
         }
+        return VELOC_IGNORED;
 
     case command_t::CHECKPOINT:
         // delete old versions on persistent mount point
@@ -60,6 +62,7 @@ int versioning_module_t::process_command(const command_t &c) {
                 command_t old = c;
                 old.version = *it;
                 cfg.storage()->remove(old);
+                catalog.remove(old);
                 if (!meta.empty())
                     unlink(old.meta_filename(meta).c_str());
                 it = ph.erase(it);
@@ -3,6 +3,7 @@
 
 #include "common/config.hpp"
 #include "common/command.hpp"
+#include "modules/version_catalog.hpp"
 
 #include <mutex>
 #include <set>
@@ -14,10 +15,11 @@ class versioning_module_t {
     std::map<std::string, checkpoint_history_t> persistent_history, scratch_history;
     int max_versions, scratch_versions;
     const config_t &cfg;
+    version_catalog_t &catalog;
     std::string meta = "";
 
 public:
-    versioning_module_t(const config_t &c);
+    versioning_module_t(const config_t &c, version_catalog_t &vc);
     ~versioning_module_t() { }
     int process_command(const command_t &c);
 };
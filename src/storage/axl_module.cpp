@@ -45,7 +45,7 @@ err:
 bool axl_module_t::flush(const command_t &cmd) {
     // memory-based API
     if (cmd.original[0] == 0)
-        return axl_transfer_file(cmd.filename(scratch), cmd.filename(persistent));
+        return axl_transfer_file(cmd.source(scratch), cmd.filename(persistent));
     // file-based API
     if (!axl_transfer_file(cmd.filename(scratch), cmd.original))
         return false;
@@ -57,8 +57,8 @@ bool axl_module_t::flush(const command_t &cmd) {
     return true;
 }
 
-bool axl_module_t::restore(const command_t &cmd) {
-    return axl_transfer_file(cmd.filename(persistent), cmd.filename(scratch));
+bool axl_module_t::restore(const command_t &cmd, const std::string &dest) {
+    return axl_transfer_file(cmd.filename(persistent), dest.empty() ? cmd.filename(scratch) : dest);
 }
 
 axl_module_t::~axl_module_t() {
@@ -11,7 +11,7 @@ public:
     axl_module_t(const std::string &scratch, const std::string &persistent, const std::string &axl_type_str);
     virtual ~axl_module_t();
     virtual bool flush(const command_t &cmd);
-    virtual bool restore(const command_t &cmd);
+    virtual bool restore(const command_t &cmd, const std::string &dest = "");
 };
 
 #endif //__AXL_MODULE_HPP
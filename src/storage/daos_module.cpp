@@ -1,6 +1,8 @@
 #include "daos_module.hpp"
 #include "common/file_util.hpp"
 
+#include <vector>
+#include <cstring>
 #include <sys/mman.h>
 #include <unistd.h>
 #include <fcntl.h>
@@ -74,7 +76,7 @@ bool daos_module_t::flush(const command_t &cmd) {
         ERROR("cannot open DAOS object id (" << oid.lo << ", " << oid.hi << "); error = " << rc);
         return false;
     }
-    std::string source = cmd.filename(scratch);
+    std::string source = cmd.source(scratch);
     int fi = open(source.c_str(), O_RDONLY);
     ssize_t size = file_size(source);
     if (fi == -1 || size == -1) {
@@ -101,7 +103,7 @@ bool daos_module_t::flush(const command_t &cmd) {
     return true;
 }
 
-bool daos_module_t::restore(const command_t &cmd) {
+bool daos_module_t::restore(const command_t &cmd, const std::string &target) {
     daos_obj_id_t oid = generate_kv_id(cmd.unique_id);
     daos_handle_t oh;
     int rc = daos_kv_open(coh, oid, DAOS_OO_RW, &oh, NULL);
@@ -116,7 +118,7 @@ bool daos_module_t::restore(const command_t &cmd) {
         ERROR("cannot get size of key " << cmd.stem() << "; error code = " << rc);
         return false;
     }
-    std::string dest = cmd.filename(scratch);
+    std::string dest = target.empty() ? cmd.filename(scratch) : target;
     int fo = open(dest.c_str(), O_CREAT | O_TRUNC | O_RDWR, 0644);
     if (fo == -1) {
         ERROR("cannot open destination " << dest << "; error = " << std::strerror(errno));
@@ -147,6 +149,52 @@ bool daos_module_t::restore(const command_t &cmd) {
     return true;
 }
 
+// KV values can only be fetched as a whole, so the checkpoint is kept in memory while it is being read
+class daos_reader_t : public storage_reader_t {
+    std::vector<char> buffer;
+
+public:
+    daos_reader_t(size_t size) : buffer(size) { }
+    char *data() {
+        return buffer.data();
+    }
+    virtual size_t size() const {
+        return buffer.size();
+    }
+    virtual bool read(char *buf, size_t size, size_t offset) {
+        if (offset + size > buffer.size())
+            return false;
+        memcpy(buf, buffer.data() + offset, size);
+        return true;
+    }
+};
+
+storage_reader_t *daos_module_t::open_reader(const command_t &cmd) {
+    daos_obj_id_t oid = generate_kv_id(cmd.unique_id);
+    daos_handle_t oh;
+    int rc = daos_kv_open(coh, oid, DAOS_OO_RW, &oh, NULL);
+    if (rc) {
+        ERROR("cannot open DAOS object id (" << oid.lo << ", " << oid.hi << "); error = " << rc);
+        return NULL;
+    }
+    size_t size;
+    rc = daos_kv_get(oh, DAOS_TX_NONE, 0, cmd.stem().c_str(), &size, NULL, NULL);
+    if (rc) {
+        daos_kv_close(oh, NULL);
+        ERROR("cannot get size of key " << cmd.stem() << "; error code = " << rc);
+        return NULL;
+    }
+    daos_reader_t *reader = new daos_reader_t(size);
+    rc = daos_kv_get(oh, DAOS_TX_NONE, 0, cmd.stem().c_str(), &size, reader->data(), NULL);
+    daos_kv_close(oh, NULL);
+    if (rc) {
+        ERROR("daos_kv_get failed for " << cmd.stem() << "; error code = " << rc);
+        delete reader;
+        return NULL;
+    }
+    return reader;
+}
+
 bool daos_module_t::exists(const command_t &cmd) {
     daos_obj_id_t oid = generate_kv_id(cmd.unique_id);
     daos_handle_t oh;
@@ -16,9 +16,10 @@ public:
     virtual ~daos_module_t();
     virtual void get_versions(const command_t &cmd, std::set<int> &result);
     virtual bool flush(const command_t &cmd);
-    virtual bool restore(const command_t &cmd);
+    virtual bool restore(const command_t &cmd, const std::string &dest = "");
     virtual bool remove(const command_t &cmd);
     virtual bool exists(const command_t &cmd);
+    virtual storage_reader_t *open_reader(const command_t &cmd);
 };
 
 #endif //__DAOS_MODULE_HPP
@@ -0,0 +1,241 @@
+#include "dedup_module.hpp"
+#include "common/file_util.hpp"
+
+#include <vector>
+#include <sys/mman.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <openssl/sha.h>
+
+//#define __DEBUG
+#include "common/debug.hpp"
+
+static const char MANIFEST_MAGIC[8] = {'V', 'E', 'L', 'O', 'C', 'D', 'D', 'P'};
+
+struct manifest_entry_t {
+    unsigned char hash[SHA256_DIGEST_LENGTH];
+    size_t size;
+};
+
+// random values used by the gear rolling hash to find chunk boundaries
+static const struct gear_table_t {
+    uint64_t v[256];
+    gear_table_t() {
+        uint64_t x = 0x9e3779b97f4a7c15ull;
+        for (int i = 0; i < 256; i++) {
+            uint64_t z = (x += 0x9e3779b97f4a7c15ull);
+            z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+            z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+            v[i] = z ^ (z >> 31);
+        }
+    }
+} gear;
+
+static std::string to_hex(const unsigned char *hash) {
+    static const char digits[] = "0123456789abcdef";
+    std::string result(2 * SHA256_DIGEST_LENGTH, '0');
+    for (int i = 0; i < SHA256_DIGEST_LENGTH; i++) {
+        result[2 * i] = digits[hash[i] >> 4];
+        result[2 * i + 1] = digits[hash[i] & 0xf];
+    }
+    return result;
+}
+
+static bool read_manifest(const std::string &fname, size_t &size, std::vector<manifest_entry_t> &entries) {
+    const size_t head_size = sizeof(MANIFEST_MAGIC) + 2 * sizeof(size_t);
+    ssize_t total = file_size(fname);
+    if (total < (ssize_t)head_size)
+        return false;
+    std::vector<unsigned char> buff(total);
+    if (!read_file(fname, buff.data(), total) || memcmp(buff.data(), MANIFEST_MAGIC, sizeof(MANIFEST_MAGIC)) != 0)
+        return false;
+    size_t count;
+    memcpy(&size, buff.data() + sizeof(MANIFEST_MAGIC), sizeof(size_t));
+    memcpy(&count, buff.data() + sizeof(MANIFEST_MAGIC) + sizeof(size_t), sizeof(size_t));
+    if (total != (ssize_t)(head_size + count * sizeof(manifest_entry_t)))
+        return false;
+    entries.resize(count);
+    memcpy(entries.data(), buff.data() + head_size, count * sizeof(manifest_entry_t));
+    return true;
+}
+
+dedup_module_t::dedup_module_t(const std::string &s, const std::string &p) : posix_module_t(s, p) {
+}
+
+std::string dedup_module_t::chunk_dir(const command_t &cmd) {
+    return persistent + "/" + std::string(cmd.name) + "-" + std::to_string(cmd.unique_id) + ".chunks";
+}
+
+bool dedup_module_t::write_chunk(const std::string &dir, int version, const unsigned char *buff, size_t size, unsigned char *hash) {
+    SHA256(buff, size, hash);
+    std::string chunk = dir + "/" + to_hex(hash);
+    if (access(chunk.c_str(), F_OK) == 0)
+        return true;
+    // concurrent flushes of the same store may write the same chunk, make it appear atomically
+    std::string tmp = chunk + "." + unique_suffix() + "-" + std::to_string(version) + ".tmp";
+    if (!write_file(tmp, (unsigned char *)buff, size))
+        return false;
+    if (rename(tmp.c_str(), chunk.c_str()) != 0) {
+        ERROR("cannot rename " << tmp << " to " << chunk << ", error = " << std::strerror(errno));
+        unlink(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool dedup_module_t::flush(const command_t &cmd) {
+    // file-based API is not deduplicated
+    if (cmd.original[0] != 0)
+        return posix_module_t::flush(cmd);
+
+    std::string source = cmd.source(scratch), dir = chunk_dir(cmd);
+    if (!check_dir(dir)) {
+        ERROR("chunk directory " << dir << " inaccessible");
+        return false;
+    }
+    int fd = open(source.c_str(), O_RDONLY);
+    if (fd == -1) {
+        ERROR("cannot open " << source << ", error = " << std::strerror(errno));
+        return false;
+    }
+    size_t size = lseek(fd, 0, SEEK_END);
+    unsigned char *buff = NULL;
+    if (size > 0) {
+        buff = (unsigned char *)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (buff == MAP_FAILED) {
+            ERROR("cannot mmap " << source << ", error = " << std::strerror(errno));
+            close(fd);
+            return false;
+        }
+        madvise(buff, size, MADV_SEQUENTIAL);
+    }
+    close(fd);
+
+    TIMER_START(io_timer);
+    std::shared_lock<std::shared_mutex> lock(store_lock);
+    const uint64_t cut_mask = (uint64_t)(AVG_CHUNK - 1) << (64 - __builtin_ctzll(AVG_CHUNK));
+    std::vector<manifest_entry_t> entries;
+    bool success = true;
+    for (size_t start = 0; start < size && success; ) {
+        // cut where the rolling hash over the last bytes matches the mask, within the min/max chunk bounds
+        size_t end = std::min(size, start + MAX_CHUNK), pos = std::min(end, start + MIN_CHUNK);
+        for (uint64_t h = 0; pos < end; pos++) {
+            h = (h << 1) + gear.v[buff[pos]];
+            if ((h & cut_mask) == 0) {
+                pos++;
+                break;
+            }
+        }
+        manifest_entry_t e;
+        e.size = pos - start;
+        success = write_chunk(dir, cmd.version, buff + start, e.size, e.hash);
+        entries.push_back(e);
+        start = pos;
+    }
+    if (buff != NULL)
+        munmap(buff, size);
+    if (!success)
+        return false;
+
+    // the manifest replaces the checkpoint file on the persistent mount point
+    size_t count = entries.size();
+    std::vector<unsigned char> manifest(sizeof(MANIFEST_MAGIC) + 2 * sizeof(size_t) + count * sizeof(manifest_entry_t));
+    memcpy(manifest.data(), MANIFEST_MAGIC, sizeof(MANIFEST_MAGIC));
+    memcpy(manifest.data() + sizeof(MANIFEST_MAGIC), &size, sizeof(size_t));
+    memcpy(manifest.data() + sizeof(MANIFEST_MAGIC) + sizeof(size_t), &count, sizeof(size_t));
+    memcpy(manifest.data() + sizeof(MANIFEST_MAGIC) + 2 * sizeof(size_t), entries.data(), count * sizeof(manifest_entry_t));
+    std::string tmp = dir + "/" + cmd.stem() + ".manifest", dest = cmd.filename(persistent);
+    if (!write_file(tmp, manifest.data(), manifest.size()))
+        return false;
+    if (rename(tmp.c_str(), dest.c_str()) != 0) {
+        ERROR("cannot rename " << tmp << " to " << dest << ", error = " << std::strerror(errno));
+        unlink(tmp.c_str());
+        return false;
+    }
+    TIMER_STOP(io_timer, "flushed " << source << " as " << count << " chunks");
+    return true;
+}
+
+bool dedup_module_t::restore(const command_t &cmd, const std::string &target) {
+    std::string source = cmd.filename(persistent), dest = target.empty() ? cmd.filename(scratch) : target, dir = chunk_dir(cmd);
+    size_t size;
+    std::vector<manifest_entry_t> entries;
+    if (!read_manifest(source, size, entries))
+        return posix_module_t::restore(cmd, dest);
+
+    TIMER_START(io_timer);
+    std::shared_lock<std::shared_mutex> lock(store_lock);
+    int fd = open(dest.c_str(), O_CREAT | O_TRUNC | O_WRONLY, 0644);
+    if (fd == -1) {
+        ERROR("cannot open destination " << dest << ", error = " << std::strerror(errno));
+        return false;
+    }
+    std::vector<unsigned char> buff(MAX_CHUNK);
+    unsigned char hash[SHA256_DIGEST_LENGTH];
+    size_t offset = 0;
+    bool success = true;
+    for (auto &e : entries) {
+        // chunks are named after their content, so a chunk with the right size can still be corrupted
+        std::string chunk = dir + "/" + to_hex(e.hash);
+        if (e.size > MAX_CHUNK || file_size(chunk) != (ssize_t)e.size || !read_file(chunk, buff.data(), e.size)
+            || memcmp(SHA256(buff.data(), e.size, hash), e.hash, SHA256_DIGEST_LENGTH) != 0) {
+            ERROR("chunk " << chunk << " missing or corrupted, cannot restore " << dest);
+            success = false;
+            break;
+        }
+        if (pwrite(fd, buff.data(), e.size, offset) != (ssize_t)e.size) {
+            ERROR("cannot write " << e.size << " bytes to " << dest << ", error = " << std::strerror(errno));
+            success = false;
+            break;
+        }
+        offset += e.size;
+    }
+    success &= offset == size;
+    close(fd);
+    if (success)
+        TIMER_STOP(io_timer, "restored " << dest << " from " << entries.size() << " chunks");
+    return success;
+}
+
+storage_reader_t *dedup_module_t::open_reader(const command_t &cmd) {
+    size_t size;
+    std::vector<manifest_entry_t> entries;
+    if (read_manifest(cmd.filename(persistent), size, entries))
+        return NULL;
+    return posix_module_t::open_reader(cmd);
+}
+
+bool dedup_module_t::remove(const command_t &cmd) {
+    if (!posix_module_t::remove(cmd))
+        return false;
+
+    // garbage collect the chunks no longer referenced by the remaining versions
+    std::unique_lock<std::shared_mutex> lock(store_lock);
+    std::set<std::string> live;
+    parse_dir(persistent, cmd.name,
+              [&](const std::string &f, int id, int) {
+                  size_t size;
+                  std::vector<manifest_entry_t> entries;
+                  if (id == cmd.unique_id && read_manifest(f, size, entries))
+                      for (auto &e : entries)
+                          live.insert(to_hex(e.hash));
+              });
+    std::string dir = chunk_dir(cmd);
+    DIR *entry = opendir(dir.c_str());
+    if (entry == NULL)
+        return true;
+    dirent *dentry;
+    size_t removed = 0;
+    while ((dentry = readdir(entry)) != NULL)
+        if (dentry->d_type == DT_REG && live.find(dentry->d_name) == live.end()) {
+            unlink((dir + "/" + dentry->d_name).c_str());
+            removed++;
+        }
+    closedir(entry);
+    DBG("removed " << cmd << ", garbage collected " << removed << " chunks");
+    return true;
+}
+
+dedup_module_t::~dedup_module_t() {
+}
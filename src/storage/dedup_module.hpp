@@ -0,0 +1,27 @@
+#ifndef __DEDUP_MODULE_HPP
+#define __DEDUP_MODULE_HPP
+
+#include "posix_module.hpp"
+
+#include <shared_mutex>
+
+// splits checkpoints into content-defined chunks stored once per checkpoint name and rank,
+// the persistent file of each version is replaced by a manifest listing its chunks
+class dedup_module_t : public posix_module_t {
+    static const size_t MIN_CHUNK = 1 << 14, AVG_CHUNK = 1 << 16, MAX_CHUNK = 1 << 18;
+    std::shared_mutex store_lock;
+
+    std::string chunk_dir(const command_t &cmd);
+    bool write_chunk(const std::string &dir, int version, const unsigned char *buff, size_t size, unsigned char *hash);
+
+public:
+    dedup_module_t(const std::string &scratch, const std::string &persistent);
+    virtual ~dedup_module_t();
+    virtual bool remove(const command_t &cmd);
+    virtual bool flush(const command_t &cmd);
+    virtual bool restore(const command_t &cmd, const std::string &dest = "");
+    // manifests cannot be read in place, such checkpoints are always restored to scratch first
+    virtual storage_reader_t *open_reader(const command_t &cmd);
+};
+
+#endif //__DEDUP_MODULE_HPP
@@ -1,12 +1,17 @@
 #include "posix_agg_module.hpp"
 #include "common/file_util.hpp"
 
+#include <algorithm>
+#include <cstring>
+
 #include <unistd.h>
 #include <fcntl.h>
 
 //#define __DEBUG
 #include "common/debug.hpp"
 
+static const size_t BATCH_CHUNK = 1 << 26, MAX_GAP = 1 << 20;
+
 posix_agg_module_t::posix_agg_module_t(const std::string &s, const std::string &p, const std::string &m) : posix_module_t(s, p), meta(m) {
     if (!check_dir(meta))
         FATAL("metadata directory " << meta << " inaccessible!");
@@ -20,45 +25,158 @@ void posix_agg_module_t::get_versions(const command_t &cmd, std::set<int> &resul
               });
 }
 
+void posix_agg_module_t::get_all_versions(const command_t &cmd, std::map<int, std::set<int> > &result) {
+    // aggregated files do not tell which ranks they contain
+    storage_module_t::get_all_versions(cmd, result);
+}
+
 bool posix_agg_module_t::flush(const command_t &cmd) {
     // aggregated mode supported for memory-based API only
-    return posix_transfer_file(cmd.filename(scratch), cmd.agg_filename(persistent), 0, cmd.offset);
+    return posix_transfer_file(cmd.source(scratch), cmd.agg_filename(persistent), 0, cmd.offset);
 }
 
 bool posix_agg_module_t::remove(const command_t &cmd) {
     return unlink(cmd.agg_filename(persistent).c_str());
 }
 
-bool posix_agg_module_t::restore(const command_t &cmd) {
-    // read header to find out rank offset
+bool posix_agg_module_t::read_offsets(const command_t &cmd, int first, int last, std::vector<size_t> &offsets) {
+    // the header holds the number of ranks followed by the offset of each rank, the end of the last one is unknown
     std::string meta_file = cmd.agg_filename(meta);
     int fi = open(meta_file.c_str(), O_RDONLY);
     if (fi == -1) {
         ERROR("cannot open aggregated header " << meta_file << "; error = " << std::strerror(errno));
         return false;
     }
-    long offset[2], num_ranks;
+    long num_ranks;
     ssize_t res = pread(fi, &num_ranks, sizeof(long), 0);
-    if (res == -1) {
-        ERROR("cannot read number of ranks from aggregated header " << meta_file << "; error = " << std::strerror(errno));
+    if (res != sizeof(long) || first < 0 || last >= num_ranks) {
+        ERROR("cannot read offsets of ranks " << first << "-" << last << " from aggregated header " << meta_file
+              << "; error = " << (res == -1 ? std::strerror(errno) : "rank out of range"));
         close(fi);
         return false;
     }
-    if (cmd.unique_id == num_ranks - 1) {
-        res = pread(fi, &offset[0], sizeof(long), (cmd.unique_id + 1) * sizeof(long));
-        offset[1] = std::numeric_limits<long>::max();
-    } else {
-        res = pread(fi, &offset[0], 2 * sizeof(long), (cmd.unique_id + 1) * sizeof(long));
-        offset[1] -= offset[0];
-    }
+    std::vector<long> buf(std::min((long)last + 2, num_ranks) - first);
+    res = pread(fi, buf.data(), buf.size() * sizeof(long), (first + 1) * sizeof(long));
     close(fi);
-    if (res == -1) {
-        ERROR("cannot read offset from aggregated header " << meta_file << "; error = " << std::strerror(errno));
+    if (res != (ssize_t)(buf.size() * sizeof(long))) {
+        ERROR("cannot read offsets of ranks " << first << "-" << last << " from aggregated header " << meta_file
+              << "; error = " << std::strerror(errno));
         return false;
     }
-    DBG("rank " << cmd.unique_id << ", reading from offset " << offset[0] << ", size = " << offset[1]);
+    offsets.assign(buf.begin(), buf.end());
+    if (last == num_ranks - 1)
+        offsets.push_back(std::numeric_limits<size_t>::max());
+    return true;
+}
+
+bool posix_agg_module_t::get_range(const command_t &cmd, size_t &start, size_t &size) {
+    std::vector<size_t> offsets;
+    if (!read_offsets(cmd, cmd.unique_id, cmd.unique_id, offsets))
+        return false;
+    DBG("rank " << cmd.unique_id << ", reading from offset " << offsets[0] << ", size = " << offsets[1] - offsets[0]);
+    start = offsets[0];
+    size = offsets[1] - offsets[0];
+    return true;
+}
+
+bool posix_agg_module_t::restore(const command_t &cmd, const std::string &dest) {
+    size_t offset, size;
+    if (!get_range(cmd, offset, size))
+        return false;
     // reconstruct local file from starting from rank offset
-    return posix_transfer_file(cmd.agg_filename(persistent), cmd.filename(scratch), offset[0], 0, offset[1]);
+    return posix_transfer_file(cmd.agg_filename(persistent), dest.empty() ? cmd.filename(scratch) : dest, offset, 0, size);
+}
+
+static bool write_all(int fd, const char *buf, size_t size, size_t offset) {
+    while (size > 0) {
+        ssize_t ret = pwrite(fd, buf, size, offset);
+        if (ret == -1 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            return false;
+        buf += ret;
+        size -= ret;
+        offset += ret;
+    }
+    return true;
+}
+
+bool posix_agg_module_t::restore_batch(const std::vector<command_t> &cmds, std::vector<bool> &restored) {
+    for (auto &c : cmds)
+        if (c.version != cmds[0].version || strcmp(c.name, cmds[0].name) != 0)
+            return posix_module_t::restore_batch(cmds, restored);
+    restored.assign(cmds.size(), false);
+    if (cmds.empty())
+        return true;
+    int first = std::numeric_limits<int>::max(), last = 0;
+    for (auto &c : cmds) {
+        first = std::min(first, c.unique_id);
+        last = std::max(last, c.unique_id);
+    }
+    std::vector<size_t> offsets;
+    if (!read_offsets(cmds[0], first, last, offsets))
+        return false;
+    file_reader_t source(cmds[0].agg_filename(persistent));
+    if (!source.is_open())
+        return false;
+
+    // the ranges of the ranks are read from the aggregated file in large chunks, sorted by offset
+    struct range_t {
+        size_t start, end, index;
+        int fd;
+    };
+    std::vector<range_t> ranges;
+    for (size_t i = 0; i < cmds.size(); i++) {
+        std::string dest = cmds[i].filename(scratch);
+        int fd = open(dest.c_str(), O_CREAT | O_TRUNC | O_WRONLY, 0644);
+        if (fd == -1) {
+            ERROR("cannot open destination " << dest << "; error = " << std::strerror(errno));
+            continue;
+        }
+        int k = cmds[i].unique_id - first;
+        ranges.push_back({offsets[k], std::min(offsets[k + 1], source.size()), i, fd});
+        restored[i] = true;
+    }
+    std::sort(ranges.begin(), ranges.end(), [](const range_t &a, const range_t &b) { return a.start < b.start; });
+    TIMER_START(io_timer);
+    std::vector<char> buffer(BATCH_CHUNK);
+    for (size_t i = 0, j; i < ranges.size(); i = j) {
+        // ranges separated by small gaps are read as a whole
+        size_t end = ranges[i].end;
+        for (j = i + 1; j < ranges.size() && ranges[j].start <= end + MAX_GAP; j++)
+            end = std::max(end, ranges[j].end);
+        for (size_t pos = ranges[i].start; pos < end; pos += BATCH_CHUNK) {
+            size_t len = std::min(BATCH_CHUNK, end - pos);
+            bool success = source.read(buffer.data(), len, pos);
+            for (size_t k = i; k < j; k++) {
+                size_t from = std::max(pos, ranges[k].start), to = std::min(pos + len, ranges[k].end);
+                if (from < to && !(success && write_all(ranges[k].fd, buffer.data() + from - pos, to - from, from - ranges[k].start)))
+                    restored[ranges[k].index] = false;
+            }
+        }
+    }
+    bool success = true;
+    for (auto &r : ranges) {
+        if (close(r.fd) != 0)
+            restored[r.index] = false;
+        if (!restored[r.index])
+            ERROR("cannot restore " << cmds[r.index].filename(scratch) << " from " << cmds[r.index].agg_filename(persistent));
+    }
+    for (size_t i = 0; i < cmds.size(); i++)
+        success &= restored[i];
+    TIMER_STOP(io_timer, "restored " << cmds.size() << " ranks from " << cmds[0].agg_filename(persistent));
+    return success;
+}
+
+storage_reader_t *posix_agg_module_t::open_reader(const command_t &cmd) {
+    size_t offset, size;
+    if (!get_range(cmd, offset, size))
+        return NULL;
+    file_reader_t *reader = new file_reader_t(cmd.agg_filename(persistent), offset, size);
+    if (reader->is_open())
+        return reader;
+    delete reader;
+    return NULL;
 }
 
 bool posix_agg_module_t::exists(const command_t &cmd) {
@@ -7,14 +7,20 @@ class posix_agg_module_t : public posix_module_t {
 protected:
     std::string meta;
 
+    bool read_offsets(const command_t &cmd, int first, int last, std::vector<size_t> &offsets);
+    bool get_range(const command_t &cmd, size_t &offset, size_t &size);
+
 public:
     posix_agg_module_t(const std::string &scratch, const std::string &persistent, const std::string &meta);
     virtual ~posix_agg_module_t();
     virtual void get_versions(const command_t &cmd, std::set<int> &result);
+    virtual void get_all_versions(const command_t &cmd, std::map<int, std::set<int> > &result);
     virtual bool remove(const command_t &cmd);
     virtual bool flush(const command_t &cmd);
-    virtual bool restore(const command_t &cmd);
+    virtual bool restore(const command_t &cmd, const std::string &dest = "");
+    virtual bool restore_batch(const std::vector<command_t> &cmds, std::vector<bool> &restored);
     virtual bool exists(const command_t &cmd);
+    virtual storage_reader_t *open_reader(const command_t &cmd);
 };
 
 #endif //__POSIX_AGG_MODULE_HPP
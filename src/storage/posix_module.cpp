@@ -19,6 +19,15 @@ void posix_module_t::get_versions(const command_t &cmd, std::set<int> &result) {
               });
 }
 
+void posix_module_t::get_all_versions(const command_t &cmd, std::map<int, std::set<int> > &result) {
+    result[cmd.unique_id];
+    parse_dir(persistent, cmd.name,
+              [&](const std::string &, int id, int v) {
+                  if (id >= 0)
+                      result[id].insert(v);
+              });
+}
+
 bool posix_module_t::remove(const command_t &cmd) {
     bool success = unlink(cmd.filename(persistent).c_str()) == 0;
     if (!success)
@@ -29,7 +38,7 @@ bool posix_module_t::remove(const command_t &cmd) {
 bool posix_module_t::flush(const command_t &cmd) {
     // memory-based API
     if (cmd.original[0] == 0)
-        return posix_transfer_file(cmd.filename(scratch), cmd.filename(persistent));
+        return posix_transfer_file(cmd.source(scratch), cmd.filename(persistent));
     // file-based API
     if (!posix_transfer_file(cmd.filename(scratch), cmd.original))
         return false;
@@ -41,13 +50,21 @@ bool posix_module_t::flush(const command_t &cmd) {
     return true;
 }
 
-bool posix_module_t::restore(const command_t &cmd) {
-    return posix_transfer_file(cmd.filename(persistent), cmd.filename(scratch));
+bool posix_module_t::restore(const command_t &cmd, const std::string &dest) {
+    return posix_transfer_file(cmd.filename(persistent), dest.empty() ? cmd.filename(scratch) : dest);
 }
 
 bool posix_module_t::exists(const command_t &cmd) {
     return access(cmd.filename(persistent).c_str(), R_OK) == 0;
 }
 
+storage_reader_t *posix_module_t::open_reader(const command_t &cmd) {
+    file_reader_t *reader = new file_reader_t(cmd.filename(persistent));
+    if (reader->is_open())
+        return reader;
+    delete reader;
+    return NULL;
+}
+
 posix_module_t::~posix_module_t() {
 }
@@ -11,10 +11,12 @@ public:
     posix_module_t(const std::string &scratch, const std::string &persistent);
     virtual ~posix_module_t();
     virtual void get_versions(const command_t &cmd, std::set<int> &result);
+    virtual void get_all_versions(const command_t &cmd, std::map<int, std::set<int> > &result);
     virtual bool remove(const command_t &cmd);
     virtual bool flush(const command_t &cmd);
-    virtual bool restore(const command_t &cmd);
+    virtual bool restore(const command_t &cmd, const std::string &dest = "");
     virtual bool exists(const command_t &cmd);
+    virtual storage_reader_t *open_reader(const command_t &cmd);
 };
 
 #endif //__POSIX_MODULE_HPP
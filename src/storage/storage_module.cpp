@@ -1,11 +1,68 @@
 #include "storage_module.hpp"
 
+#include <cstring>
+#include <algorithm>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+//#define __DEBUG
+#include "common/debug.hpp"
+
+storage_reader_t::~storage_reader_t() {
+}
+
+file_reader_t::file_reader_t(const std::string &fname, size_t offset, size_t size) : start(offset) {
+    fd = open(fname.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) != 0) {
+        ERROR("cannot open " << fname << " for reading, error = " << std::strerror(errno));
+        if (fd != -1)
+            close(fd);
+        fd = -1;
+        return;
+    }
+    length = (size_t)st.st_size > offset ? std::min(size, (size_t)st.st_size - offset) : 0;
+}
+
+file_reader_t::~file_reader_t() {
+    if (fd != -1)
+        close(fd);
+}
+
+size_t file_reader_t::size() const {
+    return length;
+}
+
+bool file_reader_t::read(char *buf, size_t size, size_t offset) {
+    if (offset + size > length)
+        return false;
+    while (size > 0) {
+        ssize_t ret = pread(fd, buf, size, start + offset);
+        if (ret == -1 && errno == EINTR)
+            continue;
+        if (ret <= 0) {
+            ERROR("cannot read " << size << " bytes at offset " << start + offset << ", error = "
+                  << (ret == 0 ? "unexpected end of file" : std::strerror(errno)));
+            return false;
+        }
+        buf += ret;
+        size -= ret;
+        offset += ret;
+    }
+    return true;
+}
+
 storage_module_t::storage_module_t(...) {
 }
 
 void storage_module_t::get_versions(const command_t &, std::set<int> &) {
 }
 
+void storage_module_t::get_all_versions(const command_t &cmd, std::map<int, std::set<int> > &result) {
+    get_versions(cmd, result[cmd.unique_id]);
+}
+
 bool storage_module_t::remove(const command_t &) {
     return false;
 }
@@ -14,13 +71,27 @@ bool storage_module_t::flush(const command_t &) {
     return false;
 }
 
-bool storage_module_t::restore(const command_t &) {
+bool storage_module_t::restore(const command_t &, const std::string &) {
     return false;
 }
 
+bool storage_module_t::restore_batch(const std::vector<command_t> &cmds, std::vector<bool> &restored) {
+    bool success = true;
+    restored.clear();
+    for (auto &c : cmds) {
+        restored.push_back(restore(c));
+        success &= restored.back();
+    }
+    return success;
+}
+
 bool storage_module_t::exists(const command_t &) {
     return false;
 }
 
+storage_reader_t *storage_module_t::open_reader(const command_t &) {
+    return NULL;
+}
+
 storage_module_t::~storage_module_t() {
 }
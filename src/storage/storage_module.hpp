@@ -2,16 +2,49 @@
 #define __STORAGE_MODULE_HPP
 
 #include <set>
+#include <map>
+#include <vector>
+#include <limits>
 #include "common/command.hpp"
 
+// random access to the contents of a checkpoint, reads may be issued concurrently
+class storage_reader_t {
+public:
+    virtual ~storage_reader_t();
+    virtual size_t size() const = 0;
+    virtual bool read(char *buf, size_t size, size_t offset) = 0;
+};
+
+// reader of a byte range of a file
+class file_reader_t : public storage_reader_t {
+    int fd = -1;
+    size_t start = 0, length = 0;
+
+public:
+    file_reader_t(const std::string &fname, size_t offset = 0, size_t size = std::numeric_limits<size_t>::max());
+    virtual ~file_reader_t();
+    bool is_open() const {
+        return fd != -1;
+    }
+    virtual size_t size() const;
+    virtual bool read(char *buf, size_t size, size_t offset);
+};
+
 class storage_module_t {
 public:
     storage_module_t(...);
     virtual void get_versions(const command_t &cmd, std::set<int> &result);
+    // versions of the checkpoint named as cmd for every rank found, or at least for the rank of cmd
+    virtual void get_all_versions(const command_t &cmd, std::map<int, std::set<int> > &result);
     virtual bool remove(const command_t &cmd);
     virtual bool flush(const command_t &cmd);
-    virtual bool restore(const command_t &cmd);
+    // restore a checkpoint to dest, by default its file on scratch
+    virtual bool restore(const command_t &cmd, const std::string &dest = "");
+    // restore several checkpoints at once, e.g. all ranks of a node, restored[i] tells whether cmds[i] succeeded
+    virtual bool restore_batch(const std::vector<command_t> &cmds, std::vector<bool> &restored);
     virtual bool exists(const command_t &cmd);
+    // read a checkpoint in place instead of restoring it to scratch, NULL if not supported or not available
+    virtual storage_reader_t *open_reader(const command_t &cmd);
     virtual ~storage_module_t();
 };
 
@@ -1,5 +1,6 @@
 #include "include/veloc.hpp"
 #include "common/ckpt_util.hpp"
+#include "storage/storage_module.hpp"
 
 #include <fstream>
 #include <memory>
@@ -21,7 +22,7 @@ int main(int argc, char **argv) {
     bool header = false;
     int id = -1;
     size_t size = 0;
-    std::map<int, size_t> region_info;
+    ckpt_header_t ckpt_header;
     std::string ckpt_name;
 
     // initialize both long and short form arguments
@@ -53,44 +54,87 @@ int main(int argc, char **argv) {
     if (ckpt_name == "" || (!header && id < 0))
         exit_with_usage();
 
-    size_t header_size = read_header(ckpt_name, region_info);
-    if (header_size == 0)
+    file_reader_t reader(ckpt_name);
+    if (!reader.is_open() || !read_header(reader, ckpt_header))
+        return -1;
+    auto &regions = ckpt_header.regions;
+    delta_info_t delta;
+    if (regions.count(delta_info_t::REGION_ID) > 0 && !read_delta_info(reader, ckpt_header, delta))
+        return -1;
+    compress_info_t compress;
+    if (regions.count(compress_info_t::REGION_ID) > 0 && !read_compress_info(reader, ckpt_header, compress))
         return -1;
 
     if (header) {
-        std::cout << "Header for " << ckpt_name << ":" << std::endl;
+        std::cout << "Header for " << ckpt_name << " (version " << ckpt_header.version
+                  << ", alignment = " << ckpt_header.alignment << "):" << std::endl;
+        if (delta.base_version >= 0)
+            std::cout << "Incremental checkpoint, base version = " << delta.base_version << std::endl;
+        if (!compress.regions.empty())
+            std::cout << "Compressed checkpoint, codec = " << compress.codec << ", block size = " << compress.block_size << std::endl;
         size_t total = 0;
-        for (const auto &e : region_info) {
-            std::cout << "id = " << e.first << ", size = " << e.second << std::endl;
-            total += e.second;
+        for (const auto &e : regions) {
+            if (is_reserved_region(e.first))
+                continue;
+            std::cout << "id = " << e.first << ", offset = " << e.second.offset << ", size = " << e.second.size;
+            if (e.second.flags & ckpt_header_t::FLAG_CHKSUM)
+                std::cout << ", crc32 = " << std::hex << e.second.chksum << std::dec;
+            auto it = delta.regions.find(e.first);
+            if (it != delta.regions.end())
+                std::cout << " (incremental, full size = " << it->second.size << ", " << it->second.runs.size() << " modified ranges)";
+            auto c = compress.regions.find(e.first);
+            if (c != compress.regions.end())
+                std::cout << " (compressed, full size = " << c->second.size << ")";
+            std::cout << std::endl;
+            total += e.second.size;
         }
         std::cout << "Total checkpoint size = " << total << std::endl;
         return 0;
     }
+    if (delta.regions.count(id) > 0) {
+        ERROR("region " << id << " is stored incrementally relative to version " << delta.base_version << ", cannot extract it directly");
+        return -1;
+    }
 
     try {
         std::ifstream f;
         f.exceptions(std::ifstream::failbit | std::ifstream::badbit);
         f.open(ckpt_name, std::ifstream::in | std::ifstream::binary);
-        size_t seek_offset = header_size;
-        bool found = false;
-        for (const auto &e: region_info) {
-            if (e.first == id) {
-                found = true;
-                break;
-            }
-            seek_offset += e.second;
-        }
-        if (!found)
+        auto it = regions.find(id);
+        if (it == regions.end())
             throw std::ifstream::failure("cannot find region " + std::to_string(id) + " in the header");
-        if (region_info[id] < size)
-            throw std::ifstream::failure("region " + std::to_string(id) + " is of size " + std::to_string(region_info[id]) +
+        const region_entry_t &entry = it->second;
+        auto c = compress.regions.find(id);
+        size_t full_size = c != compress.regions.end() ? c->second.size : entry.size;
+        if (full_size < size)
+            throw std::ifstream::failure("region " + std::to_string(id) + " is of size " + std::to_string(full_size) +
                                          ", which is smaller than requested size " + std::to_string(size));
-        f.seekg(seek_offset);
+        f.seekg(entry.offset);
         if (size == 0)
-            size = region_info[id];
-        std::vector<char> region(size);
-        f.read(&region[0], size);
+            size = full_size;
+        std::vector<char> region(full_size);
+        // the checksum can only be verified if all stored bytes are read
+        bool verify = (entry.flags & ckpt_header_t::FLAG_CHKSUM) && (c != compress.regions.end() || size == full_size);
+        uint32_t crc = 0;
+        if (c == compress.regions.end()) {
+            f.read(&region[0], size);
+            crc = update_chksum(0, &region[0], size);
+        } else {
+            std::vector<char> block;
+            for (size_t i = 0; i < c->second.blocks.size(); i++) {
+                size_t done = i * compress.block_size;
+                if (done >= full_size)
+                    throw std::ifstream::failure("compression descriptor of region " + std::to_string(id) + " is inconsistent");
+                size_t block_size = std::min(compress.block_size, full_size - done);
+                block.resize(c->second.blocks[i]);
+                f.read(block.data(), block.size());
+                crc = update_chksum(crc, block.data(), block.size());
+                if (!decompress_block(compress.codec, block.data(), block.size(), &region[done], block_size))
+                    throw std::ifstream::failure("cannot decompress block " + std::to_string(i) + " of region " + std::to_string(id));
+            }
+        }
+        if (verify && crc != entry.chksum)
+            throw std::ifstream::failure("checksum mismatch for region " + std::to_string(id));
         std::cout.write(&region[0], size);
     } catch (std::fstream::failure &e) {
         ERROR("cannot read from checkpoint file " << ckpt_name << ", reason: " << e.what());
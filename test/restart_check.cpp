@@ -0,0 +1,161 @@
+#include "veloc.hpp"
+
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <unistd.h>
+#include <vector>
+#include <string>
+
+/*
+    Writes three versions of a checkpoint made of raw and serialized regions, then restarts
+    from the latest one and verifies every byte. Used to check restart with the various
+    configuration options that change how checkpoints are written or read back.
+*/
+
+static const std::string CKPT_NAME = "restart_check";
+static const int LAST_VERSION = 3;
+static const size_t PATTERN_WORDS = 1 << 20, ODD_SIZE = 12345;
+
+static uint64_t pattern(int rank, int version, size_t i) {
+    uint64_t x = ((uint64_t)rank << 48) ^ ((uint64_t)version << 40) ^ i;
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    return x ^ (x >> 29);
+}
+
+struct state_t {
+    int version = 0;
+    uint64_t *words = NULL;
+    std::vector<char> odd;
+    std::string text;
+
+    state_t() : odd(ODD_SIZE) {
+        // page aligned, so that lazy restart can map it
+        if (posix_memalign((void **)&words, 4096, PATTERN_WORDS * sizeof(uint64_t)))
+            abort();
+    }
+    ~state_t() {
+        free(words);
+    }
+    void fill(int rank, int v) {
+        version = v;
+        for (size_t i = 0; i < PATTERN_WORDS; i++)
+            words[i] = pattern(rank, v, i);
+        for (size_t i = 0; i < ODD_SIZE; i++)
+            odd[i] = (char)pattern(rank, v, i + PATTERN_WORDS);
+        text.clear();
+        for (int i = 0; i < v * 1000; i++)
+            text += "rank " + std::to_string(rank) + ", version " + std::to_string(v) + "\n";
+    }
+    void clear() {
+        version = 0;
+        memset(words, 0, PATTERN_WORDS * sizeof(uint64_t));
+        memset(odd.data(), 0, ODD_SIZE);
+        text.clear();
+    }
+    bool check_words(int rank, int v) const {
+        for (size_t i = 0; i < PATTERN_WORDS; i++)
+            if (words[i] != pattern(rank, v, i)) {
+                std::cerr << "rank " << rank << ": word " << i << " differs" << std::endl;
+                return false;
+            }
+        return true;
+    }
+    bool check(int rank, int v) const {
+        state_t expected;
+        expected.fill(rank, v);
+        if (version != v) {
+            std::cerr << "rank " << rank << ": restored version " << version << ", expected " << v << std::endl;
+            return false;
+        }
+        if (!check_words(rank, v))
+            return false;
+        if (odd != expected.odd || text != expected.text) {
+            std::cerr << "rank " << rank << ": odd sized or serialized region differs" << std::endl;
+            return false;
+        }
+        return true;
+    }
+};
+
+static bool protect(veloc::client_t *ckpt, state_t &s) {
+    return ckpt->mem_protect(0, &s.version, 1, sizeof(int)) &&
+        ckpt->mem_protect(1, s.words, PATTERN_WORDS, sizeof(uint64_t)) &&
+        ckpt->mem_protect(2, s.odd.data(), ODD_SIZE, 1) &&
+        ckpt->mem_protect(3, [&s](std::ostream &out) {
+            size_t size = s.text.size();
+            out.write((char *)&size, sizeof(size));
+            out.write(s.text.data(), size);
+        }, [&s](std::istream &in) {
+            size_t size;
+            if (!in.read((char *)&size, sizeof(size)))
+                return false;
+            s.text.resize(size);
+            return (bool)in.read(&s.text[0], size);
+        });
+}
+
+static bool write_versions(veloc::client_t *ckpt, state_t &s, int rank, unsigned int pause) {
+    for (int v = 1; v <= LAST_VERSION; v++) {
+        // lets the interval of the persistent flushes elapse, so that only the last version is flushed
+        if (v == LAST_VERSION && pause > 0 && (!ckpt->checkpoint_wait() || sleep(pause) != 0))
+            return false;
+        s.fill(rank, v);
+        if (!ckpt->checkpoint(CKPT_NAME, v)) {
+            std::cerr << "rank " << rank << ": checkpoint of version " << v << " failed" << std::endl;
+            return false;
+        }
+    }
+    return ckpt->checkpoint_wait();
+}
+
+static bool restart_latest(veloc::client_t *ckpt, state_t &s, int rank) {
+    int v = ckpt->restart_test(CKPT_NAME, 0);
+    if (v != LAST_VERSION) {
+        std::cerr << "rank " << rank << ": restart test found version " << v << ", expected " << LAST_VERSION << std::endl;
+        return false;
+    }
+    s.clear();
+    if (!ckpt->restart_begin(CKPT_NAME, v)) {
+        std::cerr << "rank " << rank << ": cannot begin restart from version " << v << std::endl;
+        return false;
+    }
+    // the big region first, then the rest, as an application restoring selectively would
+    bool success = ckpt->recover_size(1) == PATTERN_WORDS * sizeof(uint64_t) &&
+        ckpt->recover_mem(VELOC_RECOVER_SOME, {1}) && s.check_words(rank, v) &&
+        ckpt->recover_mem(VELOC_RECOVER_REST, {1});
+    if (!ckpt->restart_end(success) || !success) {
+        std::cerr << "rank " << rank << ": restart from version " << v << " failed" << std::endl;
+        return false;
+    }
+    return s.check(rank, v);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 3 || argc > 4 || (std::string(argv[2]) != "checkpoint" && std::string(argv[2]) != "restart")) {
+        std::cerr << "Usage: " << argv[0] << " <veloc_cfg> checkpoint [seconds before last version] | restart" << std::endl;
+        return -1;
+    }
+    MPI_Init(&argc, &argv);
+    int rank;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+
+    bool success;
+    {
+        veloc::client_t *ckpt = veloc::get_client(MPI_COMM_WORLD, argv[1]);
+        state_t s;
+        success = protect(ckpt, s);
+        if (success && std::string(argv[2]) == "checkpoint")
+            success = write_versions(ckpt, s, rank, argc == 4 ? atoi(argv[3]) : 0);
+        else if (success)
+            success = restart_latest(ckpt, s, rank);
+        delete ckpt;
+    }
+    int local = success ? 0 : 1, failed = 0;
+    MPI_Allreduce(&local, &failed, 1, MPI_INT, MPI_SUM, MPI_COMM_WORLD);
+    if (rank == 0)
+        std::cout << argv[2] << (failed ? " failed on " + std::to_string(failed) + " rank(s)" : " succeeded") << std::endl;
+    MPI_Finalize();
+    return failed ? 1 : 0;
+}